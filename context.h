@@ -14,6 +14,11 @@
 #define WINDOW_WIDTH 640
 #define WINDOW_HEIGHT 480
 #define FPS 300
+#define MIN_FRAME_RATE 1
+#define MAX_FRAME_RATE 1000
+/* Fixed step has to stay below a tile of player movement */
+#define MIN_TICK_RATE 8
+#define MAX_TICK_RATE 1000
 #define TPS 24
 #define UPS 6
 
@@ -44,6 +49,11 @@ struct scale {
 };
 
 extern bool want_exit;
+extern bool show_stats;
+extern bool immediate_map;
+/* Redraws and fixed simulation steps per second */
+extern int32_t frame_rate;
+extern int32_t tick_rate;
 extern struct scale scale;
 extern struct image backbuf;
 
@@ -11,6 +11,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -115,8 +116,17 @@
 
 #define CAM_SPEED (5e-9)
 #define PLAYER_SPEED (6e-8)
+/* Camera slower than that (in pixels per nanosecond) stops */
+#define CAM_MIN_SPEED (0.34*FPS/SEC)
+/* Simulation does not catch up more than that after stalls */
+#define MAX_STEP_LAG (SEC/4)
+/* Margin around the screen in tiles within which map is
+ * refreshed, tiles beyond it are refreshed once they get closer */
+#define REFRESH_MARGIN 2
 
 #define MAX_LEVEL 10
+#define MAX_FPS_DIGITS 20
+#define MAX_HUD_TILES 256
 #define HANDS_LENGTH 3
 
 struct box {
@@ -133,6 +143,13 @@ enum timers {
     timer_MAX
 };
 
+struct screen_pos {
+    int32_t map_x;
+    int32_t map_y;
+    int32_t player_x;
+    int32_t player_y;
+};
+
 struct gamestate {
     struct tilemap *map;
     bool fading;
@@ -141,6 +158,16 @@ struct gamestate {
     double camera_x;
     double camera_y;
 
+    /* Simulation advances in fixed steps, positions before the
+     * last step are kept so that drawing can interpolate them */
+    struct timespec last_step;
+    double prev_camera_x;
+    double prev_camera_y;
+    double prev_player_x;
+    double prev_player_y;
+    /* Positions at the last redraw */
+    struct screen_pos drawn;
+
     struct player {
         struct box box;
         tile_t tile;
@@ -163,6 +190,17 @@ struct gamestate {
 
     struct tilemap *screens[s_MAX];
 
+    /* Fields of view cached by cell of the player */
+    struct fov_cache {
+        struct fov *fovs;
+        /* Index of the field of view + 1 for every cell of the map */
+        uint32_t *slots;
+        size_t ncells;
+        size_t count;
+        uint64_t hits;
+        uint64_t misses;
+    } fov_cache;
+
     int level;
 
     int32_t exit_x;
@@ -183,6 +221,10 @@ struct gamestate {
     struct timespec last_map_loaded;
     double avg_delta;
 
+    /* Overdraw stats */
+    uint64_t pixels_written;
+    uint64_t pixels_displayed;
+
     struct input_state {
         bool forward : 1;
         bool backward : 1;
@@ -199,7 +241,7 @@ struct tileset_desc {
 };
 
 
-static void load_map(const char *file, bool generated);
+static bool load_map(const char *file, bool generated);
 
 static void update_fps(struct timespec current, bool need_update) {
     if (need_update && game.last_redrawn)
@@ -209,12 +251,60 @@ static void update_fps(struct timespec current, bool need_update) {
     game.last_redrawn = need_update;
 }
 
-static void queue_fps(void) {
+inline static void advance_time(struct timespec *ts, int64_t delta) {
+    TIMEINC(*ts, delta);
+    if (ts->tv_nsec >= SEC) ts->tv_sec++, ts->tv_nsec -= SEC;
+    if (ts->tv_nsec < 0) ts->tv_sec--, ts->tv_nsec += SEC;
+}
+
+/* Saves positions before the simulation step, also used
+ * to prevent interpolation of teleports and rescaling */
+static void keep_positions(void) {
+    game.prev_camera_x = game.camera_x;
+    game.prev_camera_y = game.camera_y;
+    game.prev_player_x = game.player.box.x;
+    game.prev_player_y = game.player.box.y;
+}
+
+/* Positions of the map and the player on the screen,
+ * interpolated between the last two simulation steps */
+static struct screen_pos screen_positions(struct timespec current) {
+    double t = MIN(1, TIMEDIFF(game.last_step, current)/(double)(SEC/tick_rate));
+    struct screen_pos pos;
+    pos.map_x = game.prev_camera_x + (game.camera_x - game.prev_camera_x)*t + backbuf.width/2;
+    pos.map_y = game.prev_camera_y + (game.camera_y - game.prev_camera_y)*t + backbuf.height/2;
+    pos.player_x = pos.map_x + game.map->scale*(game.prev_player_x + (game.player.box.x - game.prev_player_x)*t);
+    pos.player_y = pos.map_y + game.map->scale*(game.prev_player_y + (game.player.box.y - game.prev_player_y)*t);
+    return pos;
+}
+
+static void queue_fps(struct tile_placement digits[static MAX_FPS_DIGITS]) {
     int64_t fps = SEC/game.avg_delta, i = 0;
     do {
-        tileset_queue_tile(backbuf, game.tilesets[TILESET_ASCII], '0' + (fps % 10),
-                backbuf.width - scale.interface/2*TILE_WIDTH*++i - 20, 20, scale.interface/2);
-    } while (fps /= 10);
+        digits[i] = (struct tile_placement) { MKTILE(TILESET_ASCII, '0' + (fps % 10)),
+                backbuf.width - scale.interface/2*TILE_WIDTH*(i + 1) - 20, 20 };
+    } while (++i < MAX_FPS_DIGITS && (fps /= 10));
+    tileset_queue_tiles(backbuf, game.tilesets, digits, i, scale.interface/2);
+}
+
+#define MAX_PARTS 64
+
+/* Split rect into parts that are not hidden by any of occluders */
+static size_t visible_parts(struct rect rect, const struct rect *occl, size_t nocc, struct rect parts[static MAX_PARTS]) {
+    struct rect next[MAX_PARTS];
+    size_t n = 1;
+
+    parts[0] = rect;
+    for (size_t i = 0; i < nocc; i++) {
+        size_t m = 0;
+        for (size_t j = 0; j < n; j++) {
+            assert(m + 4 <= MAX_PARTS);
+            m += rect_subtract(parts[j], occl[i], next + m);
+        }
+        memcpy(parts, next, m*sizeof *next);
+        n = m;
+    }
+    return n;
 }
 
 bool redraw(struct timespec current, bool force) {
@@ -222,47 +312,86 @@ bool redraw(struct timespec current, bool force) {
     if (!game.want_redraw && !force) return 0;
     game.want_redraw = 0;
 
-    int32_t map_x = game.camera_x + backbuf.width/2;
-    int32_t map_y = game.camera_y + backbuf.height/2;
+    uint64_t written = image_stats.pixels_written;
+    struct rect parts[MAX_PARTS];
+    size_t nparts;
+
+    game.drawn = screen_positions(current);
+    int32_t map_x = game.drawn.map_x;
+    int32_t map_y = game.drawn.map_y;
     int32_t map_h = game.map->scale*game.map->height*TILE_WIDTH;
     int32_t map_w = game.map->scale*game.map->width*TILE_WIDTH;
 
+    int64_t inv_total = TIMEDIFF(game.player.inv_start, game.player.inv_end);
+    int64_t inv_rest = MIN(TIMEDIFF(current, game.player.inv_end), inv_total);
+
+    struct tilemap *screen_to_draw = game.screens[game.state];
+
+    /* Opaque primitives hide everything below them, so collect them
+     * in drawing order and clip everything drawn earlier against them.
+     * (Sprites are translucent and never occlude anything) */
+    struct rect occluders[3] = {{map_x, map_y, map_w, map_h}};
+    size_t nocc = 1, inv_occl = 0;
+    if (inv_rest > 0) {
+        inv_occl = nocc;
+        occluders[nocc++] = (struct rect){0, 0, inv_rest*backbuf.width/inv_total, 4*scale.interface};
+    }
+    if (screen_to_draw) {
+        int32_t sx = backbuf.width/2 - screen_to_draw->width*screen_to_draw->tile_width*screen_to_draw->scale/2;
+        int32_t sy = backbuf.height/2 - screen_to_draw->height*screen_to_draw->tile_height*screen_to_draw->scale/2;
+        int32_t sw = screen_to_draw->width*screen_to_draw->tile_width*screen_to_draw->scale;
+        int32_t sh = screen_to_draw->height*screen_to_draw->tile_height*screen_to_draw->scale;
+        occluders[nocc++] = (struct rect){sx, sy, sw, sh};
+    }
+
     /* Clear screen */
-    image_queue_fill(backbuf, (struct rect){0, 0, backbuf.width, map_y}, BG_COLOR);
-    image_queue_fill(backbuf, (struct rect){0, map_y, map_x, map_h}, BG_COLOR);
-    image_queue_fill(backbuf, (struct rect){0, map_y + map_h, backbuf.width, backbuf.height - map_y - map_h}, BG_COLOR);
-    image_queue_fill(backbuf, (struct rect){map_x + map_w, map_y, backbuf.width - map_x - map_w, map_h}, BG_COLOR);
+    nparts = visible_parts((struct rect){0, 0, backbuf.width, backbuf.height}, occluders, nocc, parts);
+    for (size_t i = 0; i < nparts; i++)
+        image_queue_fill(backbuf, parts[i], BG_COLOR);
 
     /* Draw map */
-    tilemap_queue_draw(backbuf, game.map, map_x, map_y);
+    nparts = visible_parts(occluders[0], occluders + 1, nocc - 1, parts);
+    for (size_t i = 0; i < nparts; i++)
+        tilemap_queue_draw(backbuf, parts[i], game.map, map_x, map_y);
     drain_work();
 
     /* Draw player */
-    int32_t player_x = map_x + game.map->scale*game.player.box.x;
-    int32_t player_y = map_y + game.map->scale*game.player.box.y;
-    tile_t player = game.player.tile;
+    int32_t player_x = game.drawn.player_x;
+    int32_t player_y = game.drawn.player_y;
+    struct tile_placement sprites[2] = {{game.player.tile, player_x, player_y}};
+    size_t nsprites = 1;
 
-    tileset_queue_tile(backbuf, game.tilesets[TILESET_ID(player)], TILE_ID(player), player_x, player_y, game.map->scale);
+    /* Draw damage indicators */
+    int64_t dmg_diff = TIMEDIFF(game.player.last_damage, current);
+    if (dmg_diff < DMG_ANI_DUR) {
+        // Damge indicators are blue for absorbed damage
+        // and red for effective
+        tile_t dmg = (game.player.inv_at_damge_start ? TILE_PLAYER_INV_DAMAGE : TILE_PLAYER_DAMAGE) + (4*dmg_diff/(SEC/3));
+        sprites[nsprites++] = (struct tile_placement){dmg, player_x, player_y};
+    }
+
+    tileset_queue_tiles(backbuf, game.tilesets, sprites, nsprites, game.map->scale);
+    drain_work();
 
     /* Draw invincibility timer */
-    int64_t inv_total = TIMEDIFF(game.player.inv_start, game.player.inv_end);
-    int64_t inv_rest = MIN(TIMEDIFF(current, game.player.inv_end), inv_total);
     if (inv_rest > 0) {
-        image_queue_fill(backbuf, (struct rect){0, 0,
-                inv_rest*backbuf.width/inv_total, 4*scale.interface}, INV_COLOR);
+        nparts = visible_parts(occluders[inv_occl], occluders + inv_occl + 1, nocc - inv_occl - 1, parts);
+        for (size_t i = 0; i < nparts; i++)
+            image_queue_fill(backbuf, parts[i], INV_COLOR);
+        drain_work();
     }
 
+    struct tile_placement hud[MAX_HUD_TILES];
+    size_t nhud = 0;
+
     /* Draw key */
     if (game.player.has_key) {
-        tileset_queue_tile(backbuf, game.tilesets[TILESET_ID(TILE_KEY_STATIC)],
-                TILE_ID(TILE_KEY_STATIC), 20, 24 + TILE_HEIGHT*scale.interface, scale.interface);
+        hud[nhud++] = (struct tile_placement){TILE_KEY_STATIC,
+                20, 24 + TILE_HEIGHT*scale.interface};
     }
 
-    /* Draw fps counter */
-    queue_fps();
-
     /* Draw lives */
-    for (int i = 0; i < (game.player.lives + 1)/2; i++) {
+    for (int i = 0; i < (game.player.lives + 1)/2 && nhud < MAX_HUD_TILES; i++) {
         int32_t px = 20 + ((game.player.lives + 1)/2 - i - 1)*TILE_WIDTH*scale.interface/2;
         int32_t py = 24 - 8*(i & 1) ;
         tile_t lives_tile;
@@ -272,117 +401,187 @@ bool redraw(struct timespec current, bool force) {
         } else {
             lives_tile = inv_rest > 0 ? TILE_IPOISON_STATIC : TILE_POISON_STATIC;
         }
-        tileset_queue_tile(backbuf, game.tilesets[TILESET_ID(lives_tile)],
-                           TILE_ID(lives_tile), px, py, scale.interface);
-        drain_work();
+        hud[nhud++] = (struct tile_placement){lives_tile, px, py};
     }
 
-    /* Draw damage indicators */
-    int64_t dmg_diff = TIMEDIFF(game.player.last_damage, current);
-    if (dmg_diff < DMG_ANI_DUR) {
-        // Damge indicators are blue for absorbed damage
-        // and red for effective
-        tile_t dmg = (game.player.inv_at_damge_start ? TILE_PLAYER_INV_DAMAGE : TILE_PLAYER_DAMAGE) + (4*dmg_diff/(SEC/3));
-        tileset_queue_tile(backbuf, game.tilesets[TILESET_ID(dmg)], TILE_ID(dmg), player_x, player_y, game.map->scale);
-    }
+    tileset_queue_tiles(backbuf, game.tilesets, hud, nhud, scale.interface);
+
+    /* Draw fps counter */
+    struct tile_placement digits[MAX_FPS_DIGITS];
+    queue_fps(digits);
+    drain_work();
 
     /* Draw message screen if required by state */
-    struct tilemap *screen_to_draw = game.screens[game.state];
     if (screen_to_draw) {
-        int32_t sx = backbuf.width/2 - screen_to_draw->width*screen_to_draw->tile_width*screen_to_draw->scale/2;
-        int32_t sy = backbuf.height/2 - screen_to_draw->height*screen_to_draw->tile_height*screen_to_draw->scale/2;
-        tilemap_queue_draw(backbuf, screen_to_draw, sx, sy);
+        struct rect srect = occluders[nocc - 1];
+        tilemap_queue_draw(backbuf, srect, screen_to_draw, srect.x, srect.y);
         drain_work();
-
     }
 
+    game.pixels_written += image_stats.pixels_written - written;
+    game.pixels_displayed += (uint64_t)backbuf.width*backbuf.height;
 
     return 1;
 }
 
 #define VISIBILITY_RADIUS 24
+/* Field of view is one cell wider to the top
+ * and to the left, since walls reveal these cells */
+#define FOV_SIZE (2*VISIBILITY_RADIUS + 2)
+/* Cached fields of view are dropped all at
+ * once when there is no room for a new one */
+#define FOV_CACHE_SIZE 1024
+
+/* Cells visible from the center cell, bit x of row y is
+ * the cell (x - VISIBILITY_RADIUS - 1, y - VISIBILITY_RADIUS - 1)
+ * relative to the center */
+struct fov {
+    uint64_t rows[FOV_SIZE];
+};
 
 inline static char get_tiletype(int x, int y) {
-    uint32_t type = TILE_TYPE_CHAR(tilemap_get_tiletype(game.map, x, y, 1));
-    return (type == VOID) ? TILE_TYPE_CHAR(tilemap_get_tiletype(game.map, x, y, 0)) : type;
+    return tilemap_cell_type(game.map, x, y);
 }
 
-static void trace_ray(int32_t x0, int32_t y0, int32_t x1, int32_t y1) {
-    /* That is hard to implement proper vision... */
-    bool step = abs(y1 - y0) > abs(x1 - x0);
-    if (step) { SWAP(x0, y0); SWAP(x1, y1); }
-
-    if (x0 > x1) {
-        int32_t dx = abs(x1 - x0), dy = abs(y1 - y0);
-        int32_t er = dy;
-        int32_t ystep = (y0 < y1) - (y0 > y1);
-        for (int32_t y = y0, x = x0; x >= x1; x--) {
-            for (int32_t yy = y - 1; yy < y + 1; yy++)
-                for (int32_t xx = x - 1; xx < x + 1; xx++)
-                    if ((yy == y && xx == x) || get_tiletype(step ? y : x, step ? x : y) == WALL)
-                        tilemap_visit(game.map, step ? yy : xx, step ? xx: yy);
-            if (get_tiletype(step ? y : x, step ? x : y) == WALL) break;
-            er += dy;
-            if (2 * er >= dx) {
-                y += ystep;
-                er -= dx;
-                for (int32_t yy = y - 1; yy < y + 1; yy++)
-                    for (int32_t xx = x - 1; xx < x + 1; xx++)
-                        if ((yy == y && xx == x) || get_tiletype(step ? y : x, step ? x : y) == WALL)
-                            tilemap_visit(game.map, step ? yy : xx, step ? xx: yy);
-            }
-        }
+/* Slopes of symmetric shadowcasting are kept as exact fractions */
+struct slope {
+    int32_t num;
+    int32_t den;
+};
+
+struct fov_arg {
+    struct fov *fov;
+    int32_t x0;
+    int32_t y0;
+    /* Octant to map coordinates transform, column
+     * and row (depth) multipliers for x and y */
+    int32_t xx, xy, yx, yy;
+};
+
+/* Walls also reveal cells above and to the left of them,
+ * since these cells are partially covered by wall tiles */
+inline static void reveal(struct fov *fov, int32_t x, int32_t y, bool wall) {
+    uint64_t *row = &fov->rows[y + VISIBILITY_RADIUS + 1];
+    int32_t bit = x + VISIBILITY_RADIUS + 1;
+    if (wall) {
+        __atomic_fetch_or(row, 3ULL << (bit - 1), __ATOMIC_RELAXED);
+        __atomic_fetch_or(row - 1, 3ULL << (bit - 1), __ATOMIC_RELAXED);
     } else {
-        int32_t dx = x1 - x0, dy = abs(y1 - y0);
-        int32_t er = dy, ystep = (y0 < y1) - (y0 > y1);
-        for (int32_t y = y0, x = x0; x <= x1; x++) {
-            for (int32_t yy = y - 1; yy < y + 1; yy++)
-                for (int32_t xx = x - 1; xx < x + 1; xx++)
-                    if ((yy == y && xx == x) || get_tiletype(step ? y : x, step ? x : y) == WALL)
-                        tilemap_visit(game.map, step ? yy : xx, step ? xx: yy);
-            if (get_tiletype(step ? y : x, step ? x : y) == WALL) break;
-            er += dy;
-            if (2 * er >= dx) {
-                y += ystep;
-                er -= dx;
-                for (int32_t yy = y - 1; yy < y + 1; yy++)
-                    for (int32_t xx = x - 1; xx < x + 1; xx++)
-                        if ((yy == y && xx == x) || get_tiletype(step ? y : x, step ? x : y) == WALL)
-                            tilemap_visit(game.map, step ? yy : xx, step ? xx: yy);
-            }
-        }
+        __atomic_fetch_or(row, 1ULL << bit, __ATOMIC_RELAXED);
     }
 }
 
-inline static void discover(int32_t x0, int32_t y0) {
-    int32_t x = VISIBILITY_RADIUS, y = 0;
+/* Scans a row of the octant between slopes and recurses into
+ * the next row for every lit span, so every cell of the octant
+ * is checked at most once. Floor cells are only revealed when
+ * their centers are inside of the span, so the field of view
+ * is symmetric: if A sees B, B sees A */
+static void scan_octant(const struct fov_arg *arg, int32_t depth, struct slope start, struct slope end) {
+    if (depth > VISIBILITY_RADIUS) return;
+
+    /* Columns are rounded to the nearest,
+     * ties are rounded towards the span */
+    int32_t col0 = (2*depth*start.num + start.den)/(2*start.den);
+    int32_t col1 = (2*depth*end.num - end.den + 2*end.den - 1)/(2*end.den);
+
+    bool prev_wall = 0;
+    for (int32_t col = col0; col <= col1; col++) {
+        int32_t dx = col*arg->xx + depth*arg->xy;
+        int32_t dy = col*arg->yx + depth*arg->yy;
+        bool wall = get_tiletype(arg->x0 + dx, arg->y0 + dy) == WALL;
+
+        if (col*col + depth*depth <= VISIBILITY_RADIUS*(VISIBILITY_RADIUS + 1) &&
+            (wall || (col*start.den >= depth*start.num && col*end.den <= depth*end.num)))
+            reveal(arg->fov, dx, dy, wall);
+
+        if (col > col0 && prev_wall && !wall)
+            start = (struct slope){2*col - 1, 2*depth};
+        if (col > col0 && !prev_wall && wall)
+            scan_octant(arg, depth + 1, start, (struct slope){2*col - 1, 2*depth});
+        prev_wall = wall;
+    }
 
-    trace_ray(x0, y0, x0 + x, y0);
-    trace_ray(x0, y0, x0 - x, y0);
-    trace_ray(x0, y0, x0, y0 + x);
-    trace_ray(x0, y0, x0, y0 - x);
+    if (col0 <= col1 && !prev_wall)
+        scan_octant(arg, depth + 1, start, end);
+}
 
-    int32_t err = 1 - VISIBILITY_RADIUS;
-    while (x > y) {
-        y++;
+static void do_fov_octant(void *varg) {
+    scan_octant(varg, 1, (struct slope){0, 1}, (struct slope){1, 1});
+}
+
+/* Finds cells visible from (x0, y0), octants
+ * are independent and scanned in parallel */
+static void build_fov(struct fov *fov, int32_t x0, int32_t y0) {
+    static const int8_t octants[8][4] = {
+        { 1,  0,  0,  1}, { 0,  1,  1,  0}, { 0, -1,  1,  0}, {-1,  0,  0,  1},
+        {-1,  0,  0, -1}, { 0, -1, -1,  0}, { 0,  1, -1,  0}, { 1,  0,  0, -1},
+    };
 
-        if (err > 0) x--, err -= 2*x;
-        err = err + 2*y + 1;
+    memset(fov, 0, sizeof *fov);
+    reveal(fov, 0, 0, get_tiletype(x0, y0) == WALL);
+    for (size_t i = 0; i < LEN(octants); i++) {
+        struct fov_arg arg = {fov, x0, y0, octants[i][0], octants[i][1], octants[i][2], octants[i][3]};
+        submit_work(do_fov_octant, &arg, sizeof arg);
+    }
+    drain_work();
+}
 
-        if (x < y) break;
+/* Drops cached fields of view, should be called
+ * when a new map is loaded or when a wall changes */
+static void reset_fov_cache(void) {
+    struct fov_cache *cache = &game.fov_cache;
+    size_t ncells = game.map->width*game.map->height;
+    if (cache->ncells != ncells) {
+        free(cache->slots);
+        cache->slots = malloc(ncells*sizeof *cache->slots);
+        if (!cache->slots) die("Can't allocate FOV cache");
+        cache->ncells = ncells;
+    }
+    memset(cache->slots, 0, ncells*sizeof *cache->slots);
+    cache->count = 0;
+}
 
-        trace_ray(x0, y0, x + x0, y + y0);
-        trace_ray(x0, y0, -x + x0, y + y0);
-        trace_ray(x0, y0, x + x0, -y + y0);
-        trace_ray(x0, y0, -x + x0, -y + y0);
+/* Returns cached field of view of the cell,
+ * building it if it is not cached yet */
+static struct fov *get_fov(int32_t x0, int32_t y0) {
+    struct fov_cache *cache = &game.fov_cache;
+    uint32_t *slot = &cache->slots[y0*game.map->width + x0];
+    if (*slot) {
+        cache->hits++;
+        return &cache->fovs[*slot - 1];
+    }
 
-        if (x != y) {
-            trace_ray(x0, y0, y + x0, x + y0);
-            trace_ray(x0, y0, -y + x0, x + y0);
-            trace_ray(x0, y0, y + x0, -x + y0);
-            trace_ray(x0, y0, -y + x0, -x + y0);
-        }
+    cache->misses++;
+    if (!cache->fovs) {
+        cache->fovs = aligned_alloc(CACHE_LINE, FOV_CACHE_SIZE*sizeof *cache->fovs);
+        if (!cache->fovs) die("Can't allocate FOV cache");
     }
+    if (cache->count == FOV_CACHE_SIZE) reset_fov_cache();
+
+    struct fov *fov = &cache->fovs[cache->count];
+    build_fov(fov, x0, y0);
+    *slot = ++cache->count;
+    return fov;
+}
+
+/* Marks cells visible from (x0, y0) as visited */
+static void discover(int32_t x0, int32_t y0) {
+    struct fov tmp, *fov = &tmp;
+    if (x0 >= 0 && x0 < (int32_t)game.map->width && y0 >= 0 && y0 < (int32_t)game.map->height)
+        fov = get_fov(x0, y0);
+    else
+        build_fov(fov, x0, y0);
+
+    struct rect rect = {x0 - VISIBILITY_RADIUS - 1, y0 - VISIBILITY_RADIUS - 1, FOV_SIZE, FOV_SIZE};
+    tilemap_visit_rows(game.map, rect, fov->rows);
+}
+
+/* Changes tile of the current map, cached fields
+ * of view are dropped if it changes walls */
+static void set_map_tile(int32_t x, int32_t y, int32_t layer, tile_t tile) {
+    bool was_wall = get_tiletype(x, y) == WALL;
+    tilemap_set_tile(game.map, x, y, layer, tile);
+    if (was_wall != (get_tiletype(x, y) == WALL)) reset_fov_cache();
 }
 
 inline static void next_level(void) {
@@ -393,10 +592,13 @@ inline static void next_level(void) {
         game.state = s_normal;
         snprintf(buf, sizeof buf, "data/map_%d.txt", game.level);
 
-        load_map(buf, stat(buf, &st) != 0);
+        // Fall back to generated map if the file is malformed
+        if (!load_map(buf, stat(buf, &st) != 0))
+            load_map(buf, 1);
 
         game.camera_x = -game.player.box.x*scale.map;
         game.camera_y = -game.player.box.y*scale.map;
+        keep_positions();
 
         discover((game.player.box.x + game.map->tile_width/2)/game.map->tile_width,
                  (game.player.box.y + game.map->tile_height/2)/game.map->tile_height);
@@ -408,12 +610,13 @@ inline static void next_level(void) {
 inline static struct box get_bounding_box_for(char cell, int32_t x, int32_t y) {
     struct box bb = {x*TILE_HEIGHT, y*TILE_WIDTH, TILE_WIDTH, TILE_HEIGHT};
     switch (cell) {
-    case WALL:
-        if (get_tiletype(x, y + 1) != WALL) bb.height /= 2;
-        char left = get_tiletype(x - 1, y);
-        char right = get_tiletype(x + 1, y);
-        if (left == VOID && right != VOID) bb.width /= 2, bb.x += TILE_WIDTH/2;
-        else if (left != VOID && right == VOID) bb.width /= 2;
+    case WALL:;
+        uint8_t shape = tilemap_cell_shape(game.map, x, y);
+        if (shape & TILEMAP_SHAPE_OPEN_BELOW) bb.height /= 2;
+        switch (shape & (TILEMAP_SHAPE_SOLID_LEFT | TILEMAP_SHAPE_SOLID_RIGHT)) {
+        case TILEMAP_SHAPE_SOLID_RIGHT: bb.width /= 2, bb.x += TILE_WIDTH/2; break;
+        case TILEMAP_SHAPE_SOLID_LEFT: bb.width /= 2; break;
+        }
         break;
     case TRAP:
         return (struct box) {
@@ -454,8 +657,8 @@ static void move_camera(int64_t tick_delta) {
     double cam_dy = -pow((game.camera_y + (game.player.box.y + game.player.box.height/2)*game.map->scale)/y_speed_scale, 3) * tick_delta * CAM_SPEED;
 
     // Remove annoing slow moving camera
-    if (fabs(cam_dx) < 0.34*tick_delta/game.avg_delta) cam_dx = 0;
-    if (fabs(cam_dy) < 0.34*tick_delta/game.avg_delta) cam_dy = 0;
+    if (fabs(cam_dx) < CAM_MIN_SPEED*tick_delta) cam_dx = 0;
+    if (fabs(cam_dy) < CAM_MIN_SPEED*tick_delta) cam_dy = 0;
 
     game.camera_x += MAX(-scale.dpi, MIN(cam_dx, scale.dpi));
     game.camera_y += MAX(-scale.dpi, MIN(cam_dy, scale.dpi));
@@ -531,7 +734,7 @@ static void move_player(int64_t tick_delta, struct timespec current) {
                             game.player.inv_end = current;
                         TIMEINC(game.player.inv_end, inc);
                     }
-                    tilemap_set_tile(game.map, x, y, 1, NOTILE);
+                    set_map_tile(x, y, 1, NOTILE);
                     game.want_redraw = 1;
                 }
                 break;
@@ -591,6 +794,23 @@ int64_t time_until_next_timer(struct timespec current) {
     return MAX(0, delta);
 }
 
+/* Part of the map that is refreshed, in tiles */
+static struct rect map_view(void) {
+    double tile_w = game.map->tile_width*game.map->scale;
+    double tile_h = game.map->tile_height*game.map->scale;
+    int32_t map_x = game.camera_x + backbuf.width/2;
+    int32_t map_y = game.camera_y + backbuf.height/2;
+    int32_t x0 = floor(-map_x/tile_w) - REFRESH_MARGIN;
+    int32_t y0 = floor(-map_y/tile_h) - REFRESH_MARGIN;
+    int32_t x1 = ceil((backbuf.width - map_x)/tile_w) + REFRESH_MARGIN;
+    int32_t y1 = ceil((backbuf.height - map_y)/tile_h) + REFRESH_MARGIN;
+    return (struct rect){x0, y0, x1 - x0, y1 - y0};
+}
+
+inline static struct rect whole_map(struct tilemap *map) {
+    return (struct rect){0, 0, map->width, map->height};
+}
+
 int64_t tick(struct timespec current) {
     int64_t random_time = TIMEDIFF(current, game.timers[random_tick_timer]);
     if (random_time <= 10000LL) {
@@ -604,7 +824,7 @@ int64_t tick(struct timespec current) {
         tilemap_animation_tick(game.map);
         if (game.screens[game.state]) {
             tilemap_animation_tick(game.screens[game.state]);
-            game.want_redraw |= tilemap_refresh(game.screens[game.state]);
+            game.want_redraw |= tilemap_refresh(game.screens[game.state], whole_map(game.screens[game.state]));
         }
         game.player.tile = tileset_next_tile(game.tilesets[TILESET_ID(game.player.tile)], game.player.tile);
         game.timers[animation_timer] = current;
@@ -613,12 +833,26 @@ int64_t tick(struct timespec current) {
 
     int64_t tick_time = TIMEDIFF(current, game.timers[tick_timer]);
     if (tick_time <= 10000LL || game.tick_early) {
-        int64_t tick_delta = SEC/FPS - tick_time;
+        /* Time since the last step is the accumulator, it is consumed
+         * in fixed steps so that gameplay does not depend on frame rate */
+        int64_t step = SEC/tick_rate, max_lag = MAX(MAX_STEP_LAG, step);
+        if (TIMEDIFF(game.last_step, current) > max_lag) {
+            game.last_step = current;
+            advance_time(&game.last_step, -max_lag);
+        }
+        while (TIMEDIFF(game.last_step, current) >= step) {
+            advance_time(&game.last_step, step);
+            keep_positions();
 
-        move_camera(tick_delta);
+            move_camera(step);
+
+            if (game.state == s_normal)
+                move_player(step, game.last_step);
+        }
 
-        if (game.state == s_normal)
-            move_player(tick_delta, current);
+        /* Drawn positions also move between steps */
+        struct screen_pos pos = screen_positions(current);
+        game.want_redraw |= memcmp(&pos, &game.drawn, sizeof pos) != 0;
 
         int64_t fadein_diff = TIMEDIFF(game.last_map_loaded, current);
         game.want_redraw |= TIMEDIFF(game.player.inv_end, current) < 0 ||
@@ -630,14 +864,15 @@ int64_t tick(struct timespec current) {
         } else if (game.fading) {
             game.fading = 0;
             tilemap_fade(game.map, 0);
+            game.want_redraw = 1;
         }
 
         game.tick_early = 0;
         game.timers[tick_timer] = current;
-        TIMEINC(game.timers[tick_timer], SEC/FPS);
+        TIMEINC(game.timers[tick_timer], SEC/frame_rate);
     }
 
-    game.want_redraw |= tilemap_refresh(game.map);
+    game.want_redraw |= tilemap_refresh(game.map, map_view());
     return time_until_next_timer(current);
 }
 
@@ -662,7 +897,12 @@ inline static void change_scale(double inc) {
     scale.map = MAX(1., MIN(scale.map + inc, 20));
     game.camera_x = game.camera_x*scale.map/old_scale;
     game.camera_y = game.camera_y*scale.map/old_scale;
+    keep_positions();
     tilemap_set_scale(game.map, scale.map);
+    /* Sprites are lazily pre-scaled for the new scale */
+    if (scale.map != old_scale && old_scale != scale.interface)
+        for (size_t i = 0; i < NTILESETS; i++)
+            tileset_drop_sprites(game.tilesets[i], old_scale);
     game.want_redraw = 1;
 }
 
@@ -718,7 +958,7 @@ void handle_key(uint8_t kc, uint32_t st, bool pressed) {
         if (dist2((game.player.box.x + game.player.box.width/2)/game.map->tile_width,
                   (game.player.box.y + game.player.box.height/2)/game.map->tile_height,
                 game.exit_x, game.exit_y) < HANDS_LENGTH*HANDS_LENGTH && game.player.has_key) {
-            tilemap_set_tile(game.map, game.exit_x, game.exit_y, 1, TILE_EXIT);
+            set_map_tile(game.exit_x, game.exit_y, 1, TILE_EXIT);
             game.player.has_key = 0;
             game.want_redraw = 1;
         }
@@ -831,7 +1071,7 @@ static tile_t decode_decoration(const char *m, ssize_t w, ssize_t h, int x, int
     return NOTILE;
 }
 
-static void load_map(const char *file, bool generated) {
+static bool load_map(const char *file, bool generated) {
     char *addr = NULL;
     size_t width = 0, height = 0;
     struct stat statbuf = {0};
@@ -840,13 +1080,13 @@ static void load_map(const char *file, bool generated) {
         int fd = open(file, O_RDONLY);
         if (fd < 0) {
             warn("Can't open tile map '%s': %s", file, strerror(errno));
-            return;
+            return 0;
         }
 
         if (fstat(fd, &statbuf) < 0) {
             warn("Can't stat tile map '%s': %s", file, strerror(errno));
             close(fd);
-            return;
+            return 0;
         }
 
         // +1 to make file contents NULL-terminated
@@ -855,7 +1095,7 @@ static void load_map(const char *file, bool generated) {
 
         if (addr == MAP_FAILED) {
             warn("Can't mmap tile map '%s': %s", file, strerror(errno));
-            return;
+            return 0;
         }
 
         char *nel = addr;
@@ -870,6 +1110,15 @@ static void load_map(const char *file, bool generated) {
                     width = newnel - nel;
                 }
                 newnel++;
+            } else if (*nel) {
+                /* Last line without trailing newline is a row too */
+                height++;
+                if (width) {
+                    if (width != strlen(nel))
+                        goto format_error;
+                } else {
+                    width = strlen(nel);
+                }
             }
             nel = newnel;
         } while (nel);
@@ -882,37 +1131,50 @@ static void load_map(const char *file, bool generated) {
         addr = generate_map(width, height, time.tv_nsec);
     }
 
-    if (!height) {
+    if (!height || !width) {
 format_error:
         warn("Wrong tile tile map '%s' format", file);
         if (generated) free(addr);
         else munmap(addr, statbuf.st_size + 1);
-        return;
+        return 0;
     }
 
-    if (game.map) free_tilemap(game.map);
-    game.map = create_tilemap(width, height, TILE_WIDTH, TILE_HEIGHT, game.tilesets, NTILESETS);
-    tilemap_set_scale(game.map, scale.map);
+    /* Layers are decoded first and uploaded at once */
+    tile_t *layers = malloc(TILEMAP_LAYERS*width*height*sizeof *layers);
+    if (!layers) {
+        warn("Can't allocate tile map '%s'", file);
+        if (generated) free(addr);
+        else munmap(addr, statbuf.st_size + 1);
+        return 0;
+    }
+    tile_t *ground = layers, *items = layers + width*height, *decor = layers + 2*width*height;
+    for (size_t i = 0; i < TILEMAP_LAYERS*width*height; i++)
+        layers[i] = NOTILE;
 
     int32_t x = 0, y = 0;
     bool has_key = 0;
+    game.exit_x = game.exit_y = -1;
     for (char *ptr = addr, c; (c = *ptr); ptr++) {
+        if (c != '\n' && ((size_t)x >= width || (size_t)y >= height)) {
+            free(layers);
+            goto format_error;
+        }
         switch(c) {
         case WALL: /* wall */;
-            tilemap_set_tile(game.map, x, y, 0, decode_wall(addr, width, height, x, y));
+            ground[y*width + x] = decode_wall(addr, width, height, x, y);
             x++;
             break;
         case VOID: /* void */
-            tilemap_set_tile(game.map, x++, y, 0, TILE_VOID);
+            ground[y*width + x++] = TILE_VOID;
             break;
         case PLAYER: /* player start */
-            game.player.box.x = x*game.map->tile_width;
-            game.player.box.y = y*game.map->tile_height;
-            tilemap_set_tile(game.map, x, y, 0, decode_floor(addr, width, height, x, y));
+            game.player.box.x = x*TILE_WIDTH;
+            game.player.box.y = y*TILE_HEIGHT;
+            ground[y*width + x] = decode_floor(addr, width, height, x, y);
             x++;
             break;
         case TRAP: /* trap */
-            tilemap_set_tile(game.map, x++, y, 0, TILE_TRAP);
+            ground[y*width + x++] = TILE_TRAP;
             break;
         case KEY1: /* exit key */
             has_key = 1;
@@ -929,36 +1191,44 @@ format_error:
             case SIPOISON: tile = TILE_SIPOISON; break;
             case KEY1: tile = TILE_KEY; break;
             }
-            tilemap_set_tile(game.map, x, y, 0, decode_floor(addr, width, height, x, y));
-            tilemap_set_tile(game.map, x++, y, 1, tile);
+            ground[y*width + x] = decode_floor(addr, width, height, x, y);
+            items[y*width + x++] = tile;
             break;
         }
         case EXIT: /* exit */
         case CEXIT: /* closed exit */
             game.exit_x = x, game.exit_y = y;
-            tilemap_set_tile(game.map, x, y, 1, TILE_CLOSED_EXIT);
+            items[y*width + x] = TILE_CLOSED_EXIT;
             // fallthrough
         case FLOOR: /* floor */
-            tilemap_set_tile(game.map, x, y, 0, decode_floor(addr, width, height, x, y));
+            ground[y*width + x] = decode_floor(addr, width, height, x, y);
             x++;
             break;
         case '\n': /* new line */
             x = 0, y++;
             break;
         default:
-            free_tilemap(game.map);
-            game.map = NULL;
+            free(layers);
             goto format_error;
         }
     }
 
     // Open exit if map has no key
-    if (!has_key) tilemap_set_tile(game.map, game.exit_x, game.exit_y, 1, TILE_EXIT);
+    if (!has_key && game.exit_x >= 0) items[game.exit_y*width + game.exit_x] = TILE_EXIT;
 
     // Decorate map
-    for (x = 0; x < (int)width; x++)
-        for (y = 0; y < (int)height; y++)
-            tilemap_set_tile(game.map, x, y, 2, decode_decoration(addr, width, height, x, y));
+    for (y = 0; y < (int)height; y++)
+        for (x = 0; x < (int)width; x++)
+            decor[y*width + x] = decode_decoration(addr, width, height, x, y);
+
+    if (game.map) free_tilemap(game.map);
+    game.map = create_tilemap(width, height, TILE_WIDTH, TILE_HEIGHT, game.tilesets, NTILESETS, order_linear, NULL);
+    tilemap_set_scale(game.map, scale.map);
+    tilemap_set_immediate(game.map, immediate_map);
+    reset_fov_cache();
+    for (size_t i = 0; i < TILEMAP_LAYERS; i++)
+        tilemap_set_rect(game.map, (struct rect){0, 0, width, height}, i, layers + i*width*height, width);
+    free(layers);
 
     if (generated) free(addr);
     else munmap(addr, statbuf.st_size + 1);
@@ -967,10 +1237,13 @@ format_error:
 
     // Set map load time to current for fade-in effect
     clock_gettime(CLOCK_TYPE, &game.last_map_loaded);
+    return 1;
 }
 
 static struct tilemap *create_screen(size_t width, size_t height) {
-    struct tilemap *map  = create_tilemap(width, height, TILE_WIDTH, TILE_HEIGHT, game.tilesets, NTILESETS);
+    struct tilemap *map  = create_tilemap(width, height, TILE_WIDTH, TILE_HEIGHT, game.tilesets, NTILESETS, order_linear, NULL);
+    tile_t tiles[STATIC_SCREEN_WIDTH*STATIC_SCREEN_HEIGHT];
+    assert(width*height <= LEN(tiles));
     for (size_t y = 0; y < height; y++) {
         for (size_t x = 0; x < width; x++) {
             tile_t tile = NOTILE;
@@ -988,10 +1261,11 @@ static struct tilemap *create_screen(size_t width, size_t height) {
                 else if (x == width - 1) tile = TILE_FLOOR_RIGHT;
                 else tile = TILE_FLOOR_(r);
             }
-            tilemap_set_tile(map, x, y, 0, tile);
+            tiles[y*width + x] = tile;
             tilemap_visit(map, x, y);
         }
     }
+    tilemap_set_rect(map, (struct rect){0, 0, width, height}, 0, tiles, width);
     tilemap_set_scale(map, scale.interface/2);
     return map;
 }
@@ -1014,7 +1288,7 @@ static struct tilemap *create_death_screen(void) {
         for (size_t x = 0; x < map->width; x++)
             if (!uniform(0, 6)) tilemap_set_tile(map, x, y, 1,
                     uniform(0, 1) ? TILE_BONES_1 : TILE_BONES_2);
-    tilemap_refresh(map);
+    tilemap_refresh(map, whole_map(map));
     return map;
 }
 
@@ -1030,7 +1304,7 @@ static struct tilemap *create_win_screen(void) {
     draw_message(map, 2, 3, "Congratulations!");
     draw_message(map, 0, 4, "Press DEL to restart");
     draw_message(map, 3, 5, "or ESC to exit");
-    tilemap_refresh(map);
+    tilemap_refresh(map, whole_map(map));
     return map;
 }
 
@@ -1046,13 +1320,11 @@ static struct tilemap *create_greet_screen(void) {
     draw_message(map, 5, 2, "GREETINGS!");
     draw_message(map, 11, 4, "ESC w");
     draw_message(map, 14, 5, "asd");
-    tilemap_refresh(map);
+    tilemap_refresh(map, whole_map(map));
     return map;
 }
 
-static void do_load(void *varg) {
-    struct tileset_desc *arg = varg;
-
+static void load_tileset(const struct tileset_desc *arg) {
     struct tile *tiles = calloc(arg->x*arg->y + (arg->i == TILESET_STATIC), sizeof(*tiles));
     tile_t tile_id = 0;
     for (size_t y = 0; y < arg->y; y++) {
@@ -1106,9 +1378,10 @@ static void init_tiles(void) {
         {"data/ascii.png", 16, 16, 0, TILESET_ASCII},
     };
 
+    /* Images are converted in parallel by load_image(),
+     * so tilesets themselves are loaded one by one */
     for (size_t i = 0; i < NTILESETS; i++)
-        submit_work(do_load, tileset_descs + i, sizeof *tileset_descs);
-    drain_work();
+        load_tileset(tileset_descs + i);
 
     struct {
         tile_t tile;
@@ -1184,7 +1457,8 @@ void init(void) {
 
     game.player.box.width = TILE_WIDTH;
     game.player.box.height = TILE_HEIGHT;
-    game.avg_delta = SEC/FPS;
+    game.avg_delta = SEC/frame_rate;
+    game.last_step = game.last_frame;
     game.seed = game.last_frame.tv_nsec;
 
     init_tiles();
@@ -1197,6 +1471,19 @@ void init(void) {
 }
 
 void cleanup(void) {
+    if (show_stats && game.pixels_displayed) {
+        info("Overdraw: %.3f pixels written per displayed pixel",
+             game.pixels_written/(double)game.pixels_displayed);
+    }
+    if (show_stats) {
+        info("Image pool: %"PRIu64" hits, %"PRIu64" misses",
+             image_stats.pool_hits, image_stats.pool_misses);
+        info("FOV cache: %"PRIu64" hits, %"PRIu64" misses",
+             game.fov_cache.hits, game.fov_cache.misses);
+    }
+
+    free(game.fov_cache.fovs);
+    free(game.fov_cache.slots);
     free_tilemap(game.map);
     for (size_t i = 0; i < s_MAX; i++)
         if (game.screens[i]) free_tilemap(game.screens[i]);
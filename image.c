@@ -1,5 +1,6 @@
 /* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
 
+#define _GNU_SOURCE
 #define _POSIX_C_SOURCE 200809L
 
 #include "image.h"
@@ -11,6 +12,7 @@
 #include <math.h>
 #include <smmintrin.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -27,6 +29,126 @@
 #include "stb_image.h"
 #pragma GCC diagnostic pop
 
+/* Images not smaller than a huge page are
+ * allocated with mmap() and backed by huge pages
+ * if the kernel allows it, so that scanning
+ * large map buffers does not thrash the TLB */
+#define HUGE_PAGE_SIZE (2UL << 20)
+#define SMALL_PAGE_SIZE 4096UL
+
+/* Recently freed mapped buffers are kept to be reused
+ * by images of the same size class, so that level loads
+ * and window resizes do not remap memory every time */
+#define POOL_ENTRIES 8
+#define POOL_BUDGET (256UL << 20)
+
+struct pool_entry {
+    color_t *data;
+    size_t size;
+    int shmid;
+};
+
+static struct pool_entry pool[POOL_ENTRIES];
+static size_t pool_count, pool_bytes;
+
+/* Rounds size up to the size class, classes are spaced by
+ * at most a quarter of their size, so buffers can be reused
+ * by images of slightly different size */
+static size_t size_class(size_t size, size_t unit) {
+    size_t n = (size + unit - 1)/unit;
+    if (n > 4) {
+        size_t step = (size_t)1 << (sizeof(long)*8 - 3 - __builtin_clzl(n));
+        n = (n + step - 1) & ~(step - 1);
+    }
+    return n*unit;
+}
+
+static size_t image_size(int32_t width, int32_t height, bool shm) {
+    size_t stride = (width + 3) & ~3;
+    size_t size = stride * height * sizeof(color_t);
+    if (size >= HUGE_PAGE_SIZE)
+        return size_class(size, HUGE_PAGE_SIZE);
+    if (shm)
+        return size_class(size, SMALL_PAGE_SIZE);
+    return (size + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+}
+
+static color_t *pool_get(size_t size, int *shmid) {
+    /* Most recently freed buffers are preferred */
+    for (size_t i = pool_count; i-- > 0; ) {
+        if (pool[i].size == size && (pool[i].shmid >= 0) == !!shmid) {
+            color_t *data = pool[i].data;
+            if (shmid) *shmid = pool[i].shmid;
+            pool_bytes -= size;
+            memmove(pool + i, pool + i + 1, (--pool_count - i)*sizeof *pool);
+            image_stats.pool_hits++;
+            return data;
+        }
+    }
+    image_stats.pool_misses++;
+    return NULL;
+}
+
+static void pool_release(struct pool_entry *ent) {
+    munmap(ent->data, ent->size);
+    if (ent->shmid >= 0) close(ent->shmid);
+}
+
+static void pool_put(color_t *data, size_t size, int shmid) {
+    struct pool_entry ent = { data, size, shmid };
+    if (size > POOL_BUDGET) {
+        pool_release(&ent);
+        return;
+    }
+
+    /* Evict least recently freed buffers */
+    while (pool_count == POOL_ENTRIES || pool_bytes + size > POOL_BUDGET) {
+        pool_bytes -= pool[0].size;
+        pool_release(&pool[0]);
+        memmove(pool, pool + 1, --pool_count*sizeof *pool);
+    }
+
+    pool[pool_count++] = ent;
+    pool_bytes += size;
+}
+
+void drain_image_pool(void) {
+    while (pool_count)
+        pool_release(&pool[--pool_count]);
+    pool_bytes = 0;
+}
+
+static color_t *alloc_pixels(size_t size) {
+    if (size < HUGE_PAGE_SIZE)
+        return aligned_alloc(CACHE_LINE, size);
+
+    color_t *pooled = pool_get(size, NULL);
+    if (pooled) return pooled;
+
+    /* Explicit huge pages are only
+     * available when reserved by the system */
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED) return addr;
+
+    /* Otherwise map huge page aligned
+     * region and hint transparent huge pages */
+    uint8_t *raw = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+
+    uint8_t *data = (uint8_t *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (data > raw) munmap(raw, data - raw);
+    munmap(data + size, raw + HUGE_PAGE_SIZE - data);
+
+    madvise(data, size, MADV_HUGEPAGE);
+    return (color_t *)data;
+}
+
+static void free_pixels(color_t *data, size_t size) {
+    if (size < HUGE_PAGE_SIZE) free(data);
+    else pool_put(data, size, -1);
+}
 
 struct image create_shm_image(int32_t width, int32_t height) {
     struct image im = {
@@ -35,7 +157,13 @@ struct image create_shm_image(int32_t width, int32_t height) {
         .shmid = -1,
     };
     size_t stride = (width + 3) & ~3;
-    size_t size = stride * height * sizeof(color_t);
+    size_t size = image_size(width, height, 1);
+
+    im.data = pool_get(size, &im.shmid);
+    if (im.data) {
+        memset(im.data, 0, stride*height*sizeof(color_t));
+        return im;
+    }
 
     char temp[] = "/renderer-XXXXXX";
     int32_t attempts = 16;
@@ -58,6 +186,11 @@ struct image create_shm_image(int32_t width, int32_t height) {
     im.data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, im.shmid, 0);
     if (im.data == MAP_FAILED) goto error;
 
+    /* Shared memory can only use transparent
+     * huge pages, and only if enabled for shmem */
+    if (size >= HUGE_PAGE_SIZE)
+        madvise(im.data, size, MADV_HUGEPAGE);
+
     return im;
 
 error:
@@ -73,58 +206,110 @@ struct image create_image(int32_t width, int32_t height) {
         .shmid = -1,
     };
     size_t stride = (width + 3) & ~3;
-    size_t size = stride * height * sizeof(color_t);
 
-    im.data = aligned_alloc(CACHE_LINE, size);
+    im.data = alloc_pixels(image_size(width, height, 0));
+    if (!im.data) {
+        die("Can't allocate image %dx%d", width, height);
+    }
+
+    /* Pooled buffers are not zeroed */
     memset(im.data, 0, stride*height*sizeof(color_t));
 
     return im;
 }
 
+struct do_import_arg {
+    const color_t *src;
+    color_t *dst;
+    ssize_t width;
+    ssize_t height;
+    ssize_t sstride;
+    ssize_t dstride;
+};
+
+static HOT void do_import(void *varg) {
+    struct do_import_arg *arg = varg;
+
+    /* We need to swap channels since we expect BGR
+     * And also X11 uses premultiplied alpha channel */
+
+    const __m128i zero = _mm_set1_epi32(0x00000000);
+    const __m128i div  = _mm_set1_epi16(-32639);
+    const __m128i swz  = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    const __m128i allo = _mm_setr_epi32(0xFF03FF03, 0xFF03FF03, 0xFF07FF07, 0xFF07FF07);
+    const __m128i alhi = _mm_setr_epi32(0xFF0BFF0B, 0xFF0BFF0B, 0xFF0FFF0F, 0xFF0FFF0F);
+    /* Alpha itself is multiplied by 255/255 */
+    const __m128i aone = _mm_setr_epi16(0, 0, 0, 0xFF, 0, 0, 0, 0xFF);
+
+    for (ssize_t j = 0; j < arg->height; j++) {
+        const color_t *src = arg->src + j*arg->sstride;
+        color_t *dst = arg->dst + j*arg->dstride;
+        ssize_t i = 0;
+
+        for (; i + 4 <= arg->width; i += 4) {
+            __m128i px = _mm_shuffle_epi8(_mm_loadu_si128((const void *)(src + i)), swz);
+            __m128i al_0 = _mm_or_si128(_mm_shuffle_epi8(px, allo), aone);
+            __m128i al_1 = _mm_or_si128(_mm_shuffle_epi8(px, alhi), aone);
+            __m128i mul_0 = _mm_mullo_epi16(_mm_cvtepu8_epi16(px), al_0);
+            __m128i mul_1 = _mm_mullo_epi16(_mm_unpackhi_epi8(px, zero), al_1);
+            __m128i div_0 = _mm_srli_epi16(_mm_mulhi_epu16(mul_0, div), 7);
+            __m128i div_1 = _mm_srli_epi16(_mm_mulhi_epu16(mul_1, div), 7);
+            _mm_store_si128((void *)(dst + i), _mm_packus_epi16(div_0, div_1));
+        }
+
+        for (; i < arg->width; i++) {
+            color_t col = src[i];
+            uint8_t a = color_a(col);
+            dst[i] = mk_color(color_b(col)*a/255, color_g(col)*a/255, color_r(col)*a/255, a);
+        }
+
+        for (; i < arg->dstride; i++)
+            dst[i] = 0;
+    }
+}
+
 struct image load_image(const char *file) {
     int x, y, n;
     color_t *image = (void *)stbi_load(file, &x, &y, &n, sizeof(color_t));
-    size_t stride = (x + 3) & ~3;
     if (!image) {
         die("Can't load image: %s", stbi_failure_reason());
     }
 
-    color_t *restrict data = aligned_alloc(CACHE_LINE, x*y*sizeof(color_t));
+    size_t stride = (x + 3) & ~3;
+    color_t *data = alloc_pixels(image_size(x, y, 0));
+    if (!data) {
+        die("Can't allocate image: %s", file);
+    }
 
-    // We need to swap channels since we expect BGR
-    // And also X11 uses premultiplied alpha channel
-    // (And this is a one-time conversion, so speed does not matter)
-    for (size_t yi = 0; yi < (size_t)y; yi++) {
-        for (size_t xi = 0; xi < (size_t)x; xi++) {
-            color_t col = image[xi+yi*x];
-            uint8_t a = color_a(col);
-            uint8_t r = color_r(col);
-            uint8_t g = color_g(col);
-            uint8_t b = color_b(col);
-            data[yi*stride+xi] = mk_color(b*a/255., g*a/255., r*a/255., a);
-        }
+    ssize_t block = (y + nproc - 1)/nproc;
+    for (ssize_t yi = 0; yi < y; yi += block) {
+        struct do_import_arg arg = {
+            image + yi*x, data + yi*stride,
+            x, MIN(block, y - yi), x, stride,
+        };
+        submit_work(do_import, &arg, sizeof arg);
     }
+    drain_work();
 
     free(image);
 
     return (struct image) { .width = x, .height = y, .shmid = -1, .data = data };
 }
 
-
 void free_image(struct image *im) {
+    bool mapped = im->data && im->data != MAP_FAILED;
     if (im->shmid >= 0) {
-        size_t stride = (im->width + 3) & ~3;
-        if (im->data && im->data != MAP_FAILED)
-            munmap(im->data, stride * im->height * sizeof(color_t));
-        close(im->shmid);
+        if (mapped) pool_put(im->data, image_size(im->width, im->height, 1), im->shmid);
+        else close(im->shmid);
     } else {
-        if (im->data && im->data != MAP_FAILED)
-            free(im->data);
+        if (mapped) free_pixels(im->data, image_size(im->width, im->height, 0));
     }
     im->shmid = -1;
     im->data = NULL;
 }
 
+struct image_stats image_stats;
+
 struct do_fill_arg {
     color_t *ptr;
     color_t fg;
@@ -146,6 +331,16 @@ static HOT void do_fill_unaligned(void *varg) {
     }
 }
 
+static HOT void do_fill_opaque(void *varg) {
+    struct do_fill_arg *arg = varg;
+
+    /* Opaque color replaces destination,
+     * so there's no need to read it */
+    for (ssize_t j = 0; j < arg->h; j++, arg->ptr += arg->stride)
+        for (ssize_t i = 0; i < arg->w; i++)
+            arg->ptr[i] = arg->fg;
+}
+
 static FORCEINLINE inline __m128i blend4(__m128i under, __m128i over) {
     const __m128i zero = _mm_set1_epi32(0x00000000);
     const __m128  m255 = (__m128)_mm_set1_epi32(0x00FF00FF);
@@ -175,56 +370,69 @@ static HOT void do_fill_aligned(void *varg) {
     }
 }
 
-void image_queue_fill(struct image im, struct rect rect, color_t fg) {
+static void queue_fill_bands(void (*func)(void *), struct do_fill_arg arg) {
+    ssize_t block = arg.h < 2*(ssize_t)nproc ? arg.h : (arg.h + nproc - 1)/nproc;
+    for (ssize_t h = arg.h; h > 0; h -= block, arg.ptr += block*arg.stride) {
+        arg.h = MIN(block, h);
+        submit_work(func, &arg, sizeof arg);
+    }
+}
+
+static void run_fill(void (*func)(void *), struct do_fill_arg arg, bool queue) {
+    if (!queue) func(&arg);
+    else if (func == do_fill_unaligned) submit_work(func, &arg, sizeof arg);
+    else queue_fill_bands(func, arg);
+}
+
+/* Fills rect either right away or by queueing
+ * jobs, returns the number of written pixels */
+static uint64_t fill_rect(struct image im, struct rect rect, color_t fg, bool queue) {
     color_t *data = ASSUMEALIGNED(im.data, CACHE_LINE);
     ssize_t stride = (im.width + 3) & ~3;
-    if (intersect_with(&rect, &(struct rect){0, 0, im.width, im.height})) {
-        if (rect.x & 3) {
-            ssize_t pref = MIN(4 - (rect.x & 3), rect.width);
-            struct do_fill_arg arg = {
-                &data[rect.y * stride + rect.x],
-                fg, rect.height, pref, stride
-            };
-            submit_work(do_fill_unaligned, &arg, sizeof arg);
-            rect.width -= pref;
-            rect.x += pref;
-        }
+    if (!intersect_with(&rect, &(struct rect){0, 0, im.width, im.height})) return 0;
+
+    uint64_t written = (uint64_t)rect.width*rect.height;
+    if (color_a(fg) == 0xFF) {
+        run_fill(do_fill_opaque, (struct do_fill_arg) {
+            &data[rect.y * stride + rect.x],
+            fg, rect.height, rect.width, stride
+        }, queue);
+        return written;
+    }
 
-        if (rect.width & ~3) {
-            if (rect.height < 2*(int)nproc) {
-                struct do_fill_arg arg = {
-                    &data[rect.y * stride + rect.x],
-                    fg, rect.height, rect.width & ~3, stride
-                };
-                submit_work(do_fill_aligned, &arg, sizeof arg);
-            } else {
-                ssize_t block = rect.height/nproc;
-                for (ssize_t i = 0; i < nproc; i++) {
-                    struct do_fill_arg arg = {
-                        &data[(rect.y + i*block) * stride + rect.x],
-                        fg, block, rect.width & ~3, stride
-                    };
-                    submit_work(do_fill_aligned, &arg, sizeof arg);
-                }
-
-                if (nproc*block != (ssize_t)rect.height) {
-                    struct do_fill_arg arg = {
-                        &data[(rect.y + nproc*block) * stride + rect.x],
-                        fg, rect.height - nproc*block, rect.width & ~3, stride
-                    };
-                    submit_work(do_fill_aligned, &arg, sizeof arg);
-                }
-            }
-        }
+    if (rect.x & 3) {
+        ssize_t pref = MIN(4 - (rect.x & 3), rect.width);
+        run_fill(do_fill_unaligned, (struct do_fill_arg) {
+            &data[rect.y * stride + rect.x],
+            fg, rect.height, pref, stride
+        }, queue);
+        rect.width -= pref;
+        rect.x += pref;
+    }
 
-        if (rect.width & 3) {
-            struct do_fill_arg arg = {
-                &data[rect.y * stride + rect.x + (rect.width & ~3)],
-                fg, rect.height, rect.width & 3, stride
-            };
-            submit_work(do_fill_unaligned, &arg, sizeof arg);
-        }
+    if (rect.width & ~3) {
+        run_fill(do_fill_aligned, (struct do_fill_arg) {
+            &data[rect.y * stride + rect.x],
+            fg, rect.height, rect.width & ~3, stride
+        }, queue);
+    }
+
+    if (rect.width & 3) {
+        run_fill(do_fill_unaligned, (struct do_fill_arg) {
+            &data[rect.y * stride + rect.x + (rect.width & ~3)],
+            fg, rect.height, rect.width & 3, stride
+        }, queue);
     }
+    return written;
+}
+
+void image_queue_fill(struct image im, struct rect rect, color_t fg) {
+    uint64_t written = fill_rect(im, rect, fg, 1);
+    __atomic_add_fetch(&image_stats.pixels_written, written, __ATOMIC_RELAXED);
+}
+
+uint64_t image_fill(struct image im, struct rect rect, color_t fg) {
+    return fill_rect(im, rect, fg, 0);
 }
 
 static FORCEINLINE inline color_t image_sample(struct image src, ssize_t x, ssize_t y) {
@@ -298,6 +506,13 @@ static HOT void do_blt_unaligned(void *varg) {
     }
 }
 
+static HOT void do_copy(void *varg) {
+    struct do_blt_arg *arg = varg;
+
+    for (size_t j = 0; j < arg->h; j++)
+        memcpy(arg->dst + j*arg->dstride, arg->src + j*arg->sstride, arg->w*sizeof(color_t));
+}
+
 struct do_blt_scale_arg {
     ssize_t h;
     ssize_t w;
@@ -311,36 +526,34 @@ struct do_blt_scale_arg {
     struct image src;
 };
 
-static HOT void do_blt_unaligned_scaling_nearest(void *varg) {
-    struct do_blt_scale_arg *arg = varg;
+/* Scaling kernels are instantiated twice: for blending
+ * and for copying opaque source, which does not need to
+ * load destination pixels at all */
 
+static FORCEINLINE inline void blt_unaligned_scaling_nearest(struct do_blt_scale_arg *arg, bool copy) {
     for (ssize_t j = 0; j < arg->h; j++) {
         ssize_t iy = MIN(MAX(0, (arg->y0 + j*arg->yscale) >> FIXPREC), arg->src.height - 1);
         for (ssize_t i = 0; i < arg->w; i++) {
             ssize_t ix = MIN(MAX(0, (arg->x0 + i*arg->xscale) >> FIXPREC), arg->src.width - 1);
             color_t srcc = arg->src.data[iy*arg->sstride+ix];
             color_t *pdstc = &arg->dst[j * arg->dstride + i];
-            *pdstc = color_blend(*pdstc, srcc);
+            *pdstc = copy ? srcc : color_blend(*pdstc, srcc);
         }
     }
 }
 
-static HOT void do_blt_unaligned_scaling_linear(void *varg) {
-    struct do_blt_scale_arg *arg = varg;
-
+static FORCEINLINE inline void blt_unaligned_scaling_linear(struct do_blt_scale_arg *arg, bool copy) {
     for (ssize_t j = 0; j < arg->h; j++) {
         for (ssize_t i = 0; i < arg->w; i++) {
             color_t srcc = image_sample(arg->src, (arg->x0 + i*arg->xscale), (arg->y0 + j*arg->yscale));
             color_t *pdstc = &arg->dst[j * arg->dstride + i];
-            *pdstc = color_blend(*pdstc, srcc);
+            *pdstc = copy ? srcc : color_blend(*pdstc, srcc);
         }
     }
 }
 
-static HOT void do_blt_aligned_scaling_nearest(void *varg) {
-    struct do_blt_scale_arg *arg = varg;
-
-    if (arg->xscale > 0 && arg->x0 >= 0 && ((arg->x0 + arg->w*arg->xscale) >> FIXPREC) <= arg->src.width - 1) {
+static FORCEINLINE inline void blt_aligned_scaling_nearest(struct do_blt_scale_arg *arg, bool copy) {
+    if (arg->xscale > 0 && arg->x0 >= 0 && ((arg->x0 + (arg->w - 1)*arg->xscale) >> FIXPREC) <= arg->src.width - 1) {
         for (ssize_t j = 0; j < arg->h; j++) {
             color_t *sptr = arg->src.data + MIN(MAX(0, (arg->y0 + j*arg->yscale) >> FIXPREC), arg->src.height - 1)*arg->sstride;
             for (ssize_t i = 0; i < arg->w; i += 4) {
@@ -350,8 +563,7 @@ static HOT void do_blt_aligned_scaling_nearest(void *varg) {
                 ssize_t ix2 = (arg->x0 + (i + 2)*arg->xscale) >> FIXPREC;
                 ssize_t ix3 = (arg->x0 + (i + 3)*arg->xscale) >> FIXPREC;
                 const __m128i s = _mm_set_epi32(sptr[ix3], sptr[ix2], sptr[ix1], sptr[ix0]);
-                const __m128i d = _mm_load_si128(ptr);
-                _mm_store_si128(ptr, blend4(d, s));
+                _mm_store_si128(ptr, copy ? s : blend4(_mm_load_si128(ptr), s));
             }
         }
     } else {
@@ -364,165 +576,204 @@ static HOT void do_blt_aligned_scaling_nearest(void *varg) {
                 ssize_t ix2 = MAX(0, MIN((arg->x0 + (i + 2)*arg->xscale) >> FIXPREC, arg->src.width - 1));
                 ssize_t ix3 = MAX(0, MIN((arg->x0 + (i + 3)*arg->xscale) >> FIXPREC, arg->src.width - 1));
                 const __m128i s = _mm_set_epi32(sptr[ix3], sptr[ix2], sptr[ix1], sptr[ix0]);
-                const __m128i d = _mm_load_si128(ptr);
-                _mm_store_si128(ptr, blend4(d, s));
+                _mm_store_si128(ptr, copy ? s : blend4(_mm_load_si128(ptr), s));
             }
         }
     }
 }
 
-static HOT void do_blt_aligned_scaling_linear(void *varg) {
-    struct do_blt_scale_arg *arg = varg;
-
+static FORCEINLINE inline void blt_aligned_scaling_linear(struct do_blt_scale_arg *arg, bool copy) {
     for (ssize_t j = 0; j < arg->h; j++) {
         for (ssize_t i = 0; i < arg->w; i += 4) {
             void *ptr = &arg->dst[j * arg->dstride + i];
-            const __m128i d = _mm_load_si128(ptr);
             const __m128i s = _mm_set_epi32(
                 image_sample(arg->src, (arg->x0 + (i + 3)*arg->xscale), (arg->y0 + j*arg->yscale)),
                 image_sample(arg->src, (arg->x0 + (i + 2)*arg->xscale), (arg->y0 + j*arg->yscale)),
                 image_sample(arg->src, (arg->x0 + (i + 1)*arg->xscale), (arg->y0 + j*arg->yscale)),
                 image_sample(arg->src, (arg->x0 + (i + 0)*arg->xscale), (arg->y0 + j*arg->yscale)));
-            _mm_store_si128(ptr, blend4(d, s));
+            _mm_store_si128(ptr, copy ? s : blend4(_mm_load_si128(ptr), s));
         }
     }
 }
 
-void image_queue_blt(struct image dst, struct rect drect, struct image src, struct rect srect, enum sample_mode mode) {
+static HOT void do_blt_unaligned_scaling_nearest(void *varg) { blt_unaligned_scaling_nearest(varg, 0); }
+static HOT void do_blt_unaligned_scaling_linear(void *varg) { blt_unaligned_scaling_linear(varg, 0); }
+static HOT void do_blt_aligned_scaling_nearest(void *varg) { blt_aligned_scaling_nearest(varg, 0); }
+static HOT void do_blt_aligned_scaling_linear(void *varg) { blt_aligned_scaling_linear(varg, 0); }
+static HOT void do_copy_unaligned_scaling_nearest(void *varg) { blt_unaligned_scaling_nearest(varg, 1); }
+static HOT void do_copy_unaligned_scaling_linear(void *varg) { blt_unaligned_scaling_linear(varg, 1); }
+static HOT void do_copy_aligned_scaling_nearest(void *varg) { blt_aligned_scaling_nearest(varg, 1); }
+static HOT void do_copy_aligned_scaling_linear(void *varg) { blt_aligned_scaling_linear(varg, 1); }
+
+/* Indexed as [blend][mode] */
+static void (*const scaling_unaligned[2][2])(void *) = {
+    [blend_over] = { do_blt_unaligned_scaling_nearest, do_blt_unaligned_scaling_linear },
+    [blend_copy] = { do_copy_unaligned_scaling_nearest, do_copy_unaligned_scaling_linear },
+};
+
+static void (*const scaling_aligned[2][2])(void *) = {
+    [blend_over] = { do_blt_aligned_scaling_nearest, do_blt_aligned_scaling_linear },
+    [blend_copy] = { do_copy_aligned_scaling_nearest, do_copy_aligned_scaling_linear },
+};
+
+typedef void (*submit_fn)(void (*)(void *), const void *, size_t);
+
+static void run_work(void (*func)(void *), const void *data, size_t data_size) {
+    (void)data_size;
+    func((void *)data);
+}
+
+static ssize_t band_height(submit_fn submit, ssize_t width, ssize_t height) {
+    /* Small blits are not worth splitting
+     * and immediate blits are never split */
+    if (submit == run_work || width*height < 256*(ssize_t)nproc) return height;
+    return (height + nproc - 1)/nproc;
+}
+
+static uint64_t blt_clip(submit_fn submit, struct image dst, struct rect clip, struct rect drect, struct image src,
+                         struct rect srect, enum sample_mode mode, enum blend_mode blend) {
+    if (!intersect_with(&clip, &(struct rect){0, 0, dst.width, dst.height})) return 0;
+    if (UNLIKELY(drect.width <= 0 || drect.height <= 0)) return 0;
+
     bool fastpath = srect.width == drect.width && srect.height == drect.height;
 
     ssize_t xscale = ((ssize_t)srect.width << FIXPREC)/drect.width;
     ssize_t yscale = ((ssize_t)srect.height << FIXPREC)/drect.height;
 
-    drect.width = MIN(dst.width - drect.x, drect.width);
-    drect.height = MIN(dst.height - drect.y, drect.height);
-
     color_t *sdata = ASSUMEALIGNED(src.data, CACHE_LINE);
     color_t *ddata = ASSUMEALIGNED(dst.data, CACHE_LINE);
     ssize_t sstride = (src.width + 3) & ~3;
     ssize_t dstride = (dst.width + 3) & ~3;
 
     if (fastpath) {
-        /* Fast path for aligned non-resizing blits */
-        if (drect.x < 0) drect.width += drect.x, srect.x -= drect.x, drect.x = 0;
-        if (drect.y < 0) drect.height += drect.y, srect.y -= drect.y, drect.y = 0;
-        drect.height = MIN(drect.height, src.height - srect.y);
-        drect.width = MIN(drect.width, src.width - srect.x);
-        if (LIKELY(drect.width > 0 && drect.height > 0)) {
-            if (drect.x & 3) {
-                struct do_blt_arg arg = {
-                    drect.height, 4 - (drect.x & 3), dstride, sstride,
-                    &ddata[drect.y*dstride+drect.x],
-                    &sdata[srect.y*sstride+srect.x]
-                };
-                submit_work(do_blt_unaligned, &arg, sizeof arg);
-                drect.width -= 4 - (drect.x & 3);
-                srect.x += 4 - (drect.x & 3);
-                drect.x += 4 - (drect.x & 3);
+        /* Fast path for non-resizing blits */
+        if (drect.x < clip.x) drect.width -= clip.x - drect.x, srect.x += clip.x - drect.x, drect.x = clip.x;
+        if (drect.y < clip.y) drect.height -= clip.y - drect.y, srect.y += clip.y - drect.y, drect.y = clip.y;
+        drect.width = MIN(MIN(drect.width, clip.x + clip.width - drect.x), src.width - srect.x);
+        drect.height = MIN(MIN(drect.height, clip.y + clip.height - drect.y), src.height - srect.y);
+        if (UNLIKELY(drect.width <= 0 || drect.height <= 0)) return 0;
+
+        uint64_t written = (uint64_t)drect.width*drect.height;
+
+        if (blend == blend_copy) {
+            struct do_blt_arg arg = {
+                drect.height, drect.width, dstride, sstride,
+                &ddata[drect.y*dstride+drect.x],
+                &sdata[srect.y*sstride+srect.x]
+            };
+            ssize_t block = band_height(submit, drect.width, drect.height);
+            for (ssize_t h = drect.height; h > 0; h -= block) {
+                arg.h = MIN(block, h);
+                submit(do_copy, &arg, sizeof arg);
+                arg.dst += block*dstride;
+                arg.src += block*sstride;
             }
+            return written;
+        }
 
-            if (drect.width & ~3) {
-                if (drect.height*drect.width < 256*(int)nproc) {
-                    struct do_blt_arg arg = {
-                        drect.height, drect.width & ~3, dstride, sstride,
-                        &ddata[drect.y*dstride+drect.x],
-                        &sdata[srect.y*sstride+srect.x]
-                    };
-                    submit_work((uintptr_t)arg.src & 15 ? do_blt_aligned : do_blt_aligned2, &arg, sizeof arg);
-                } else {
-                    ssize_t block = drect.height/nproc;
-                    for (ssize_t i = 0; i < nproc; i++) {
-                        struct do_blt_arg arg = {
-                            block, drect.width & ~3, dstride, sstride,
-                            &ddata[(drect.y + block*i)*dstride+drect.x],
-                            &sdata[(srect.y + block*i)*sstride+srect.x]
-                        };
-                        submit_work((uintptr_t)arg.src & 15 ? do_blt_aligned : do_blt_aligned2, &arg, sizeof arg);
-                    }
-
-                    if (nproc*block != drect.height) {
-                        struct do_blt_arg arg = {
-                            drect.height - nproc*block, drect.width & ~3, dstride, sstride,
-                            &ddata[(drect.y + block*nproc)*dstride+drect.x],
-                            &sdata[(srect.y + block*nproc)*sstride+srect.x]
-                        };
-                        submit_work((uintptr_t)arg.src & 15 ? do_blt_aligned : do_blt_aligned2, &arg, sizeof arg);
-                    }
-                }
-            }
+        if (drect.x & 3) {
+            ssize_t pref = MIN(4 - (drect.x & 3), drect.width);
+            struct do_blt_arg arg = {
+                drect.height, pref, dstride, sstride,
+                &ddata[drect.y*dstride+drect.x],
+                &sdata[srect.y*sstride+srect.x]
+            };
+            submit(do_blt_unaligned, &arg, sizeof arg);
+            drect.width -= pref;
+            srect.x += pref;
+            drect.x += pref;
+        }
 
-            if (drect.width & 3) {
-                struct do_blt_arg arg = {
-                    drect.height, drect.width - (drect.width & ~3), dstride, sstride,
-                    &ddata[drect.y*dstride+(drect.width & ~3)+drect.x],
-                    &sdata[srect.y*sstride+(drect.width & ~3)+srect.x]
-                };
-                submit_work(do_blt_unaligned, &arg, sizeof arg);
+        if (drect.width & ~3) {
+            struct do_blt_arg arg = {
+                drect.height, drect.width & ~3, dstride, sstride,
+                &ddata[drect.y*dstride+drect.x],
+                &sdata[srect.y*sstride+srect.x]
+            };
+            void (*func)(void *) = (uintptr_t)arg.src & 15 ? do_blt_aligned : do_blt_aligned2;
+            ssize_t block = band_height(submit, drect.width, drect.height);
+            for (ssize_t h = drect.height; h > 0; h -= block) {
+                arg.h = MIN(block, h);
+                submit(func, &arg, sizeof arg);
+                arg.dst += block*dstride;
+                arg.src += block*sstride;
             }
         }
+
+        if (drect.width & 3) {
+            struct do_blt_arg arg = {
+                drect.height, drect.width & 3, dstride, sstride,
+                &ddata[drect.y*dstride+(drect.width & ~3)+drect.x],
+                &sdata[srect.y*sstride+(drect.width & ~3)+srect.x]
+            };
+            submit(do_blt_unaligned, &arg, sizeof arg);
+        }
+
+        return written;
     } else {
-        if (LIKELY(drect.width + MIN(drect.x, 0) > 0 && drect.height + MIN(drect.y, 0) > 0)) {
-            ssize_t sx0 = srect.x << FIXPREC;
-            if (drect.x & 3 && drect.x > 0) {
-                struct do_blt_scale_arg arg = {
-                    drect.height + MIN(drect.y, 0), 4 - (drect.x & 3), dstride, sstride,
-                    sx0, (srect.y << FIXPREC) - MIN(drect.y, 0)*yscale, xscale, yscale,
-                    &ddata[MAX(drect.y, 0) * dstride + drect.x], src,
-                };
-                submit_work(mode == sample_nearest ? do_blt_unaligned_scaling_nearest :
-                            do_blt_unaligned_scaling_linear, &arg, sizeof arg);
-                drect.width -= 4 - (drect.x & 3);
-                sx0 += (4 - ((drect.x & 3)))*xscale;
-                drect.x += 4 - (drect.x & 3);
-            } else if (drect.x < 0) {
-                drect.width += drect.x;
-                sx0 -= drect.x*xscale;
-                drect.x = 0;
-            }
+        ssize_t sx0 = (ssize_t)srect.x << FIXPREC;
+        ssize_t sy0 = (ssize_t)srect.y << FIXPREC;
+
+        if (drect.x < clip.x) sx0 += (clip.x - drect.x)*xscale, drect.width -= clip.x - drect.x, drect.x = clip.x;
+        if (drect.y < clip.y) sy0 += (clip.y - drect.y)*yscale, drect.height -= clip.y - drect.y, drect.y = clip.y;
+        drect.width = MIN(drect.width, clip.x + clip.width - drect.x);
+        drect.height = MIN(drect.height, clip.y + clip.height - drect.y);
+        if (UNLIKELY(drect.width <= 0 || drect.height <= 0)) return 0;
+
+        uint64_t written = (uint64_t)drect.width*drect.height;
+
+        if (drect.x & 3) {
+            ssize_t pref = MIN(4 - (drect.x & 3), drect.width);
+            struct do_blt_scale_arg arg = {
+                drect.height, pref, dstride, sstride,
+                sx0, sy0, xscale, yscale,
+                &ddata[drect.y * dstride + drect.x], src,
+            };
+            submit(scaling_unaligned[blend][mode], &arg, sizeof arg);
+            drect.width -= pref;
+            sx0 += pref*xscale;
+            drect.x += pref;
+        }
 
-            if (drect.width & ~3) {
-                if (drect.height*drect.width < 256*nproc) {
-                        struct do_blt_scale_arg arg = {
-                            drect.height + MIN(drect.y, 0), drect.width & ~3, dstride, sstride,
-                            sx0, (srect.y << FIXPREC) - MIN(drect.y, 0)*yscale, xscale, yscale,
-                            &ddata[MAX(drect.y, 0) * dstride + drect.x], src,
-                        };
-                        submit_work(do_blt_aligned_scaling_nearest, &arg, sizeof arg);
-                    submit_work(mode == sample_nearest ? do_blt_aligned_scaling_nearest :
-                                do_blt_aligned_scaling_linear, &arg, sizeof arg);
-                } else {
-                    ssize_t block = (drect.height - MAX(-drect.y, 0))/nproc;
-                    for (ssize_t i = 0; i < nproc; i++) {
-                        struct do_blt_scale_arg arg = {
-                            block, drect.width & ~3, dstride, sstride,
-                            sx0, (srect.y << FIXPREC) + (i*block + MAX(-drect.y, 0))*yscale, xscale, yscale,
-                            &ddata[(MAX(drect.y, 0) + i*block) * dstride + drect.x], src,
-                        };
-                        submit_work(mode == sample_nearest ? do_blt_aligned_scaling_nearest :
-                                    do_blt_aligned_scaling_linear, &arg, sizeof arg);
-                    }
-
-                    if (nproc*block != drect.height) {
-                        struct do_blt_scale_arg arg = {
-                            drect.height + MIN(drect.y, 0) - block*nproc, drect.width & ~3, dstride, sstride,
-                            sx0, (srect.y << FIXPREC) + (nproc*block+MAX(-drect.y, 0))*yscale, xscale, yscale,
-                            &ddata[(MAX(drect.y, 0) + nproc*block) * dstride + drect.x], src,
-                        };
-                        submit_work(mode == sample_nearest ? do_blt_aligned_scaling_nearest :
-                                    do_blt_aligned_scaling_linear, &arg, sizeof arg);
-                    }
-                }
+        if (drect.width & ~3) {
+            struct do_blt_scale_arg arg = {
+                drect.height, drect.width & ~3, dstride, sstride,
+                sx0, sy0, xscale, yscale,
+                &ddata[drect.y * dstride + drect.x], src,
+            };
+            ssize_t block = band_height(submit, drect.width, drect.height);
+            for (ssize_t h = drect.height; h > 0; h -= block) {
+                arg.h = MIN(block, h);
+                submit(scaling_aligned[blend][mode], &arg, sizeof arg);
+                arg.dst += block*dstride;
+                arg.y0 += block*yscale;
             }
+        }
 
-            if (drect.width & 3) {
-                struct do_blt_scale_arg arg = {
-                    drect.height + MIN(drect.y, 0), drect.width - (drect.width & ~3), dstride, sstride,
-                    sx0 + xscale*(drect.width & ~3), (srect.y << FIXPREC) - MIN(drect.y, 0)*yscale, xscale, yscale,
-                    &ddata[MAX(drect.y, 0) * dstride + drect.x + (drect.width & ~3)], src,
-                };
-                submit_work(mode == sample_nearest ? do_blt_unaligned_scaling_nearest :
-                            do_blt_unaligned_scaling_linear, &arg, sizeof arg);
-            }
+        if (drect.width & 3) {
+            struct do_blt_scale_arg arg = {
+                drect.height, drect.width & 3, dstride, sstride,
+                sx0 + xscale*(drect.width & ~3), sy0, xscale, yscale,
+                &ddata[drect.y * dstride + drect.x + (drect.width & ~3)], src,
+            };
+            submit(scaling_unaligned[blend][mode], &arg, sizeof arg);
         }
+
+        return written;
     }
 }
+
+void image_queue_blt_clip(struct image dst, struct rect clip, struct rect drect, struct image src,
+                          struct rect srect, enum sample_mode mode, enum blend_mode blend) {
+    uint64_t written = blt_clip(submit_work, dst, clip, drect, src, srect, mode, blend);
+    __atomic_add_fetch(&image_stats.pixels_written, written, __ATOMIC_RELAXED);
+}
+
+uint64_t image_blt_clip(struct image dst, struct rect clip, struct rect drect, struct image src,
+                        struct rect srect, enum sample_mode mode, enum blend_mode blend) {
+    return blt_clip(run_work, dst, clip, drect, src, srect, mode, blend);
+}
+
+void image_queue_blt(struct image dst, struct rect drect, struct image src, struct rect srect, enum sample_mode mode) {
+    image_queue_blt_clip(dst, (struct rect){0, 0, dst.width, dst.height}, drect, src, srect, mode, blend_over);
+}
@@ -22,6 +22,25 @@ enum sample_mode {
     sample_linear = 1,
 };
 
+enum blend_mode {
+    /* Premultiplied alpha 'over' operator */
+    blend_over = 0,
+    /* Source is known to be opaque, destination
+     * is overwritten without being read */
+    blend_copy = 1,
+};
+
+struct image_stats {
+    /* Number of destination pixels touched by queued operations */
+    uint64_t pixels_written;
+    /* Number of mapped image buffers reused from the pool
+     * and number of buffers that had to be mapped */
+    uint64_t pool_hits;
+    uint64_t pool_misses;
+};
+
+extern struct image_stats image_stats;
+
 FORCEINLINE inline static uint8_t color_r(color_t c) { return (c >> 16) & 0xFF; }
 
 FORCEINLINE inline static uint8_t color_g(color_t c) { return (c >> 8) & 0xFF; }
@@ -56,11 +75,25 @@ FORCEINLINE inline static color_t color_mix(color_t dstc, color_t srcc, ssize_t
 }
 
 void image_queue_fill(struct image im, struct rect rect, color_t fg);
+/* Same as image_queue_fill(), but the fill is performed right away
+ * on the calling thread, so it can be used from inside of jobs.
+ * Returns the number of written pixels (image_stats is not updated) */
+uint64_t image_fill(struct image im, struct rect rect, color_t fg);
 void image_queue_blt(struct image dst, struct rect drect, struct image src, struct rect srect, enum sample_mode mode);
+void image_queue_blt_clip(struct image dst, struct rect clip, struct rect drect, struct image src,
+                          struct rect srect, enum sample_mode mode, enum blend_mode blend);
+/* Same as image_queue_blt_clip(), but the blit is performed right away
+ * on the calling thread, so it can be used from inside of jobs.
+ * Returns the number of written pixels (image_stats is not updated) */
+uint64_t image_blt_clip(struct image dst, struct rect clip, struct rect drect, struct image src,
+                        struct rect srect, enum sample_mode mode, enum blend_mode blend);
+/* Loads image as premultiplied BGRA, should not be called from jobs */
 struct image load_image(const char *file);
 struct image create_image(int32_t width, int32_t height);
 struct image create_shm_image(int32_t width, int32_t height);
 void free_image(struct image *backbuf);
+/* Unmaps buffers retained for reuse by freed images */
+void drain_image_pool(void);
 
 #endif
 
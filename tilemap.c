@@ -1,56 +1,353 @@
 /* Copyright (c) 2021, Evgeny Baskov. All rights reserved */
 
+#define _GNU_SOURCE
+
 #include "image.h"
 #include "tilemap.h"
 #include "worker.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define BG_COLOR 0xFF25131A
+#define CACHE_MAGIC "TILECCH"
+#define CACHE_VERSION 1
+#define CACHE_SUFFIX ".cache"
+/* Pixels are page aligned so that mapped image is cache line aligned */
+#define CACHE_ALIGN 4096
+/* Memory budget for resident map chunks,
+ * chunks needed for the current draw are
+ * kept resident even if it is exceeded */
+#define MAP_CACHE_BUDGET (64UL << 20)
+/* Random state bits */
+#define RANDOM_COOLDOWN 0x80
+#define RANDOM_GEN_MASK 0x7F
+/* Maximal delay of random tile event in ticks */
+#define MAX_RANDOM_DELAY (1U << 24)
+/* Minimal number of tiles per batch job */
+#define BATCH_BAND_TILES 64
+/* Rows of chunks around visible ones that are prefetched
+ * and beyond which planes of mapped tilemaps are released */
+#define STREAM_PREFETCH 2
+#define STREAM_RELEASE 4
+#define TILEMAP_PAGE 4096
+/* Pixels of pre-scaled map kept around the visible part,
+ * so that scrolling does not rebuild it every frame */
+#define ZOOM_MARGIN 256
+/* Pre-scaled sprites are packed into atlases of
+ * SPRITE_SLOTS slots, SPRITE_COLUMNS slots per row */
+#define SPRITE_SLOTS 64
+#define SPRITE_COLUMNS 8
+/* Slot width alignment in pixels (a cache line) */
+#define SPRITE_ALIGN 16
 
-inline static bool get_dirty(struct tilemap *map, size_t x, size_t y) {
-    return map->dirty[y*((map->width + 31) >> 5) + (x >> 5)] & (1U << (x & 31));
-}
-
-inline static bool get_visited(struct tilemap *map, size_t x, size_t y) {
-    return map->visited[y*((map->width + 31) >> 5) + (x >> 5)] & (1U << (x & 31));
+inline static void cell_pos(struct tilemap *map, size_t cell, int32_t *x, int32_t *y) {
+    if (map->order == order_blocked) {
+        *x = ((cell >> 6) % map->blocks_width << 3) + (cell & 7);
+        *y = ((cell >> 6) / map->blocks_width << 3) + ((cell >> 3) & 7);
+    } else {
+        *x = cell % map->stride;
+        *y = cell / map->stride;
+    }
 }
 
-inline static void mark_dirty(struct tilemap *map, size_t x, size_t y) {
-    map->dirty[y*((map->width + 31) >> 5) + (x >> 5)] |= 1U << (x & 31);
+inline static void mark_dirty(struct tilemap *map, size_t x, size_t y, size_t cell) {
+    size_t chunk = y/TILEMAP_CHUNK*map->chunks_width + x/TILEMAP_CHUNK;
+    map->dirty[cell >> 5] |= 1U << (cell & 31);
+    map->dirty_chunks[chunk >> 6] |= 1ULL << (chunk & 63);
     map->has_dirty |= 1;
 }
 
 void tilemap_visit(struct tilemap *map, int32_t x, int32_t y) {
     if (x < 0 || x >= (int32_t)map->width) return;
     if (y < 0 || y >= (int32_t)map->height) return;
-    bool already =  map->visited[y*((map->width + 31) >> 5) + (x >> 5)] & (1U << (x & 31));
-    map->visited[y*((map->width + 31) >> 5) + (x >> 5)] |= 1U << (x & 31);
-    if (!already) mark_dirty(map, x, y);
+    size_t cell = tilemap_cell_index(map, x, y);
+    bool already = map->visited[cell >> 5] & (1U << (cell & 31));
+    map->visited[cell >> 5] |= 1U << (cell & 31);
+    if (!already) mark_dirty(map, x, y, cell);
+}
+
+void tilemap_visit_rows(struct tilemap *map, struct rect rect, const uint64_t *rows) {
+    assert(rect.width <= 64);
+
+    for (int32_t j = MAX(0, -rect.y); j < rect.height && rect.y + j < (int32_t)map->height; j++) {
+        int32_t x = MAX(0, rect.x), y = rect.y + j;
+        int32_t width = MIN(rect.x + rect.width, (int32_t)map->width) - x;
+        if (width <= 0) break;
+
+        uint64_t bits = rows[j] >> (x - rect.x);
+        if (width < 64) bits &= (1ULL << width) - 1;
+
+        if (map->order == order_blocked) {
+            for (; bits; bits &= bits - 1)
+                tilemap_visit(map, x + __builtin_ctzll(bits), y);
+            continue;
+        }
+
+        /* Rows are contiguous in linear order and since stride is
+         * a multiple of chunk width, every word is inside of one chunk */
+        for (size_t cell = tilemap_cell_index(map, x, y); bits; ) {
+            uint32_t shift = cell & 31;
+            uint32_t new = (uint32_t)(bits << shift) & ~map->visited[cell >> 5];
+            if (new) {
+                size_t chunk = y/TILEMAP_CHUNK*map->chunks_width + cell % map->stride/TILEMAP_CHUNK;
+                map->visited[cell >> 5] |= new;
+                map->dirty[cell >> 5] |= new;
+                map->dirty_chunks[chunk >> 6] |= 1ULL << (chunk & 63);
+                map->has_dirty = 1;
+            }
+            bits >>= 32 - shift;
+            cell += 32 - shift;
+        }
+    }
+}
+
+static void list_animated(struct tilemap *map, size_t idx) {
+    if (map->animated_count + 1 > map->animated_caps) {
+        size_t newcaps = 3*map->animated_caps/2 + 64;
+        uint32_t *new = realloc(map->animated, newcaps*sizeof *new);
+        assert(new);
+        map->animated = new;
+        map->animated_caps = newcaps;
+    }
+    map->animated[map->animated_count++] = idx;
+    map->animated_listed[idx >> 5] |= 1U << (idx & 31);
+}
+
+static void list_random(struct tilemap *map, size_t cell) {
+    if (map->random_pending_count + 1 > map->random_pending_caps) {
+        size_t newcaps = 3*map->random_pending_caps/2 + 64;
+        uint32_t *new = realloc(map->random_pending, newcaps*sizeof *new);
+        assert(new);
+        map->random_pending = new;
+        map->random_pending_caps = newcaps;
+    }
+    map->random_pending[map->random_pending_count++] = cell;
+}
+
+inline static tile_t load_tile(uint16_t tile) {
+    /* Zero wraps to NOTILE */
+    return (tile_t)tile - 1;
+}
+
+inline static uint16_t store_tile(tile_t tile) {
+    return tile + 1;
+}
+
+inline static void set_shape_flag(struct tilemap *map, int32_t x, int32_t y, uint8_t flag, bool set) {
+    if (x < 0 || x >= (int32_t)map->width) return;
+    if (y < 0 || y >= (int32_t)map->height) return;
+    size_t cell = tilemap_cell_index(map, x, y);
+    map->shapes[cell] = (map->shapes[cell] & ~flag) | (set ? flag : 0);
+}
+
+/* Recomputes type of the cell and updates shape
+ * flags of the cell and of its neighbours */
+static void update_type(struct tilemap *map, int32_t x, int32_t y, size_t cell) {
+    char type = VOID;
+    for (size_t i = TILEMAP_TYPE_LAYERS; i-- > 0 && type == VOID; ) {
+        tile_t tile = load_tile(map->tiles[i*map->plane_size + cell]);
+        if (tile != NOTILE) type = TILE_TYPE_CHAR(map->sets[TILESET_ID(tile)]->tiles[TILE_ID(tile)].type);
+    }
+
+    if (type == tilemap_cell_type(map, x, y)) return;
+    map->types[cell] = type ^ VOID;
+
+    uint8_t shape = map->shapes[cell] & (TILEMAP_SHAPE_SOLID_LEFT | TILEMAP_SHAPE_SOLID_RIGHT);
+    if (tilemap_cell_type(map, x, y + 1) != type) shape |= TILEMAP_SHAPE_OPEN_BELOW;
+    map->shapes[cell] = shape;
+
+    set_shape_flag(map, x, y - 1, TILEMAP_SHAPE_OPEN_BELOW, tilemap_cell_type(map, x, y - 1) != type);
+    set_shape_flag(map, x - 1, y, TILEMAP_SHAPE_SOLID_RIGHT, type != VOID);
+    set_shape_flag(map, x + 1, y, TILEMAP_SHAPE_SOLID_LEFT, type != VOID);
+}
+
+inline static void journal_change(struct tilemap *map, int32_t x, int32_t y, int32_t layer, tile_t old, tile_t new) {
+    map->journal[map->journal_head++ & (map->journal_size - 1)] = (struct tile_change){x, y, layer, old, new};
 }
 
 inline static tile_t tilemap_set_tile_unsafe(struct tilemap *map, int32_t x, int32_t y, int32_t layer, tile_t tile) {
-    mark_dirty(map, x, y);
-    tile_t *tilep = &map->tiles[layer + x*TILEMAP_LAYERS + y*TILEMAP_LAYERS*map->width];
-    tile_t old = *tilep;
-    *tilep = tile;
+    size_t cell = tilemap_cell_index(map, x, y);
+    size_t idx = layer*map->plane_size + cell;
+    mark_dirty(map, x, y, cell);
+    map->streamed[(y/TILEMAP_CHUNK) >> 6] |= 1ULL << (y/TILEMAP_CHUNK & 63);
+    tile_t old = load_tile(map->tiles[idx]);
+    map->tiles[idx] = store_tile(tile);
+    if (map->journal && tile != old)
+        journal_change(map, x, y, layer, old, tile);
+
+    if (tile != NOTILE) {
+        uint32_t type = map->sets[TILESET_ID(tile)]->tiles[TILE_ID(tile)].type;
+
+        /* Tiles that stop being animated are removed
+         * from the list lazily by tilemap_animation_tick() */
+        if ((type & (TILE_TYPE_ANIMATED | TILE_TYPE_RANDOM)) == TILE_TYPE_ANIMATED &&
+                !(map->animated_listed[idx >> 5] & (1U << (idx & 31))))
+            list_animated(map, idx);
+
+        /* Random tiles are scheduled on next random tick */
+        if (!layer && (type & TILE_TYPE_RANDOM))
+            list_random(map, idx);
+    }
+
+    if (layer < TILEMAP_TYPE_LAYERS && tile != old)
+        update_type(map, x, y, cell);
     return old;
 }
 
 inline static tile_t tilemap_get_tile_unsafe(struct tilemap *map, int32_t x, int32_t y, int32_t layer) {
-    return map->tiles[layer + x*TILEMAP_LAYERS + y*TILEMAP_LAYERS*map->width];
+    return load_tile(map->tiles[layer*map->plane_size + tilemap_cell_index(map, x, y)]);
+}
+
+/* Decoded tileset image cache file layout:
+ *     header
+ *     tile positions
+ *     padding up to CACHE_ALIGN
+ *     pixels (premultiplied BGRA, stride*height)
+ * Cache is valid while source image size and mtime match */
+
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t ntiles;
+    uint64_t file_size;
+    uint64_t src_size;
+    int64_t src_mtime_sec;
+    int64_t src_mtime_nsec;
+    int32_t width;
+    int32_t height;
+    int32_t stride;
+    uint64_t pixels_offset;
+};
+
+static bool load_cache(struct tileset *set, const char *path, struct stat *src) {
+    char cpath[PATH_MAX];
+    snprintf(cpath, sizeof cpath, "%s"CACHE_SUFFIX, path);
+
+    int fd = open(cpath, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct cache_header)) {
+        close(fd);
+        return 0;
+    }
+
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return 0;
+
+    struct cache_header *hdr = addr;
+    struct rect *pos = (struct rect *)(hdr + 1);
+    if (memcmp(hdr->magic, CACHE_MAGIC, sizeof hdr->magic) ||
+        hdr->version != CACHE_VERSION ||
+        hdr->file_size != (uint64_t)st.st_size ||
+        hdr->src_size != (uint64_t)src->st_size ||
+        hdr->src_mtime_sec != src->st_mtim.tv_sec ||
+        hdr->src_mtime_nsec != src->st_mtim.tv_nsec ||
+        hdr->stride != ((hdr->width + 3) & ~3) ||
+        hdr->ntiles != set->ntiles ||
+        hdr->pixels_offset < sizeof *hdr + set->ntiles*sizeof *pos ||
+        hdr->pixels_offset % CACHE_ALIGN ||
+        hdr->pixels_offset + (uint64_t)hdr->stride*hdr->height*sizeof(color_t) > hdr->file_size) goto stale;
+
+    for (size_t i = 0; i < set->ntiles; i++) {
+        struct rect *tp = &set->tiles[i].pos;
+        if (pos[i].x != tp->x || pos[i].y != tp->y ||
+            pos[i].width != tp->width || pos[i].height != tp->height) goto stale;
+    }
+
+    set->cache = addr;
+    set->cache_size = st.st_size;
+    set->img = (struct image) {
+        .width = hdr->width,
+        .height = hdr->height,
+        .shmid = -1,
+        .data = (color_t *)((uint8_t *)addr + hdr->pixels_offset),
+    };
+    return 1;
+
+stale:
+    munmap(addr, st.st_size);
+    return 0;
+}
+
+static void save_cache(struct tileset *set, const char *path, struct stat *src) {
+    char cpath[PATH_MAX], tpath[PATH_MAX];
+    snprintf(cpath, sizeof cpath, "%s"CACHE_SUFFIX, path);
+    snprintf(tpath, sizeof tpath, "%s"CACHE_SUFFIX".XXXXXX", path);
+
+    size_t stride = (set->img.width + 3) & ~3;
+    size_t pixels_offset = (sizeof(struct cache_header) + set->ntiles*sizeof(struct rect) +
+            CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1);
+    size_t size = pixels_offset + stride*set->img.height*sizeof(color_t);
+
+    struct cache_header hdr = {
+        .magic = CACHE_MAGIC,
+        .version = CACHE_VERSION,
+        .ntiles = set->ntiles,
+        .file_size = size,
+        .src_size = src->st_size,
+        .src_mtime_sec = src->st_mtim.tv_sec,
+        .src_mtime_nsec = src->st_mtim.tv_nsec,
+        .width = set->img.width,
+        .height = set->img.height,
+        .stride = stride,
+        .pixels_offset = pixels_offset,
+    };
+
+    /* Cache is written to temporary file and renamed
+     * so that other instances never see partial cache */
+    int fd = mkstemp(tpath);
+    if (fd < 0) goto error;
+
+    if (fchmod(fd, 0644) < 0 || ftruncate(fd, size) < 0) goto error_unlink;
+
+    uint8_t *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) goto error_unlink;
+
+    memcpy(addr, &hdr, sizeof hdr);
+    struct rect *pos = (struct rect *)(addr + sizeof hdr);
+    for (size_t i = 0; i < set->ntiles; i++)
+        pos[i] = set->tiles[i].pos;
+    memcpy(addr + pixels_offset, set->img.data, stride*set->img.height*sizeof(color_t));
+    munmap(addr, size);
+
+    if (rename(tpath, cpath) < 0) goto error_unlink;
+    close(fd);
+    return;
+
+error_unlink:
+    unlink(tpath);
+    close(fd);
+error:
+    warn("Can't write tileset cache '%s': %s", cpath, strerror(errno));
 }
 
 struct tileset *create_tileset(const char *path, struct tile *tiles, size_t ntiles) {
     struct tileset *set = calloc(1, sizeof(*set));
     assert(set);
-    set->img = load_image(path);
-    assert(set->img.data);
     set->ntiles = ntiles;
     set->tiles = tiles;
     set->refc = 1;
 
+    /* Try to map decoded image first, it's
+     * zero-copy and does not require decoding */
+    struct stat src;
+    bool has_src = stat(path, &src) == 0;
+    if (!has_src || !load_cache(set, path, &src)) {
+        set->img = load_image(path);
+        if (has_src) save_cache(set, path, &src);
+    }
+    assert(set->img.data);
+
     for (size_t i = 0; i < ntiles; i++) {
         if (set->tiles[i].pos.width > 0) {
             assert(set->tiles[i].pos.x >= 0);
@@ -71,10 +368,19 @@ struct tileset *create_tileset(const char *path, struct tile *tiles, size_t ntil
     return set;
 }
 
+static void free_sprite_cache(struct sprite_cache *cache) {
+    if (cache->atlas.data) free_image(&cache->atlas);
+    free(cache->slots);
+    *cache = (struct sprite_cache){0};
+}
+
 void unref_tileset(struct tileset *set) {
     assert(set->refc);
     if (!--set->refc) {
-        free_image(&set->img);
+        for (size_t i = 0; i < SPRITE_CACHE_SCALES; i++)
+            free_sprite_cache(&set->sprites[i]);
+        if (set->cache) munmap(set->cache, set->cache_size);
+        else free_image(&set->img);
         free(set->tiles);
         free(set);
     }
@@ -84,22 +390,183 @@ void ref_tileset(struct tileset *set) {
     set->refc++;
 }
 
+void tileset_drop_sprites(struct tileset *set, double scale) {
+    for (size_t i = 0; i < SPRITE_CACHE_SCALES; i++) {
+        if (set->sprites[i].atlas.data && set->sprites[i].scale == scale) {
+            /* Sprites can still be read by queued jobs */
+            drain_work();
+            free_sprite_cache(&set->sprites[i]);
+        }
+    }
+}
+
+/* Finds pre-scaled sprites for the scale without touching
+ * anything, so it is safe to call from jobs */
+static struct sprite_cache *find_sprites(struct tileset *set, double scale) {
+    for (size_t i = 0; i < SPRITE_CACHE_SCALES; i++)
+        if (set->sprites[i].atlas.data && set->sprites[i].scale == scale)
+            return &set->sprites[i];
+    return NULL;
+}
+
+/* Returns pre-scaled sprites for the scale, replacing
+ * the least recently used scale if there is no free one */
+static struct sprite_cache *use_sprites(struct tileset *set, double scale) {
+    struct sprite_cache *cache = find_sprites(set, scale);
+
+    if (!cache) {
+        cache = &set->sprites[0];
+        for (size_t i = 1; i < SPRITE_CACHE_SCALES && cache->atlas.data; i++)
+            if (!set->sprites[i].atlas.data || set->sprites[i].last_used < cache->last_used)
+                cache = &set->sprites[i];
+
+        if (cache->atlas.data) {
+            drain_work();
+            free_sprite_cache(cache);
+        }
+
+        int32_t width = 1, height = 1;
+        for (size_t i = 0; i < set->ntiles; i++) {
+            width = MAX(width, abs(set->tiles[i].pos.width)*scale);
+            height = MAX(height, abs(set->tiles[i].pos.height)*scale);
+        }
+
+        cache->scale = scale;
+        cache->slot_width = (width + SPRITE_ALIGN - 1) & ~(SPRITE_ALIGN - 1);
+        cache->slot_height = height;
+        cache->atlas = create_image(SPRITE_COLUMNS*cache->slot_width,
+                                    SPRITE_SLOTS/SPRITE_COLUMNS*cache->slot_height);
+        cache->slots = calloc(set->ntiles, sizeof *cache->slots);
+        if (!cache->slots) die("Can't allocate sprite cache");
+    }
+
+    cache->last_used = ++set->sprites_clock;
+    return cache;
+}
+
+/* Position of the pre-scaled tile in the atlas */
+inline static struct rect sprite_rect(struct sprite_cache *cache, struct tile *tl, size_t slot) {
+    return (struct rect) {
+        slot % SPRITE_COLUMNS*cache->slot_width,
+        slot / SPRITE_COLUMNS*cache->slot_height,
+        tl->pos.width*cache->scale,
+        tl->pos.height*cache->scale,
+    };
+}
+
+/* Scales the tile into the atlas if it is not there yet */
+static void cache_sprite(struct tileset *set, tile_t tile, double scale) {
+    struct tile *tl = &set->tiles[tile];
+
+    /* Empty and flipped tiles are not drawn at all */
+    if ((int32_t)(tl->pos.width*scale) <= 0 ||
+        (int32_t)(tl->pos.height*scale) <= 0) return;
+
+    struct sprite_cache *cache = use_sprites(set, scale);
+    if (cache->slots[tile]) return;
+
+    if (cache->nslots == SPRITE_SLOTS) {
+        drain_work();
+        memset(cache->slots, 0, set->ntiles*sizeof *cache->slots);
+        cache->nslots = 0;
+    }
+
+    struct rect drect = sprite_rect(cache, tl, cache->nslots);
+    image_blt_clip(cache->atlas, drect, drect, set->img, tl->pos, sample_nearest, blend_copy);
+    cache->slots[tile] = ++cache->nslots;
+}
+
+/* Source of the tile drawing, which is either the pre-scaled
+ * copy from the atlas or the tile itself if there is none */
+inline static struct image sprite_source(struct tileset *set, tile_t tile, double scale, struct rect *srect) {
+    struct tile *tl = &set->tiles[tile];
+    struct sprite_cache *cache = scale != 1 ? find_sprites(set, scale) : NULL;
+    if (cache && cache->slots[tile]) {
+        *srect = sprite_rect(cache, tl, cache->slots[tile] - 1);
+        return cache->atlas;
+    }
+    *srect = tl->pos;
+    return set->img;
+}
+
 void tileset_queue_tile(struct image dst, struct tileset *set, tile_t tile, int32_t x, int32_t y, double scale) {
     assert(tile < set->ntiles);
     assert(dst.data);
 
+    if (scale != 1) cache_sprite(set, tile, scale);
+
     struct tile *tl = &set->tiles[tile];
     struct rect drect = {
         x, y, tl->pos.width*scale,
         tl->pos.height*scale
     };
-    struct rect srect = {
-        tl->pos.x,
-        tl->pos.y,
-        tl->pos.width,
-        tl->pos.height
-    };
-    image_queue_blt(dst, drect, set->img, srect, 0);
+    struct rect srect;
+    struct image src = sprite_source(set, tile, scale, &srect);
+    image_queue_blt(dst, drect, src, srect, 0);
+}
+
+struct do_tiles_arg {
+    struct image dst;
+    struct rect band;
+    struct tileset **sets;
+    const struct tile_placement *tiles;
+    size_t ntiles;
+    double scale;
+};
+
+static void do_tiles(void *varg) {
+    struct do_tiles_arg *arg = varg;
+    uint64_t written = 0;
+
+    /* Placements are blitted in order, so tiles
+     * overlapping in the band are layered correctly */
+    for (size_t i = 0; i < arg->ntiles; i++) {
+        const struct tile_placement *pl = &arg->tiles[i];
+        struct tileset *set = arg->sets[TILESET_ID(pl->tile)];
+        struct tile *tl = &set->tiles[TILE_ID(pl->tile)];
+        struct rect drect = {
+            pl->x, pl->y, tl->pos.width*arg->scale,
+            tl->pos.height*arg->scale
+        };
+        if (drect.y >= arg->band.y + arg->band.height ||
+            drect.y + drect.height <= arg->band.y) continue;
+        struct rect srect;
+        struct image src = sprite_source(set, TILE_ID(pl->tile), arg->scale, &srect);
+        written += image_blt_clip(arg->dst, arg->band, drect, src, srect, sample_nearest, blend_over);
+    }
+
+    __atomic_add_fetch(&image_stats.pixels_written, written, __ATOMIC_RELAXED);
+}
+
+void tileset_queue_tiles(struct image dst, struct tileset **sets, const struct tile_placement *tiles, size_t ntiles, double scale) {
+    /* Placements are not copied, so they should
+     * be kept alive until drain_work() is called */
+    assert(dst.data);
+
+    int32_t y0 = INT32_MAX, y1 = INT32_MIN;
+    for (size_t i = 0; i < ntiles; i++) {
+        assert(TILE_ID(tiles[i].tile) < sets[TILESET_ID(tiles[i].tile)]->ntiles);
+        struct tile *tl = &sets[TILESET_ID(tiles[i].tile)]->tiles[TILE_ID(tiles[i].tile)];
+        /* Sprites are scaled once and then only copied */
+        if (scale != 1) cache_sprite(sets[TILESET_ID(tiles[i].tile)], TILE_ID(tiles[i].tile), scale);
+        y0 = MIN(y0, tiles[i].y);
+        y1 = MAX(y1, tiles[i].y + (int32_t)(tl->pos.height*scale));
+    }
+
+    y0 = MAX(y0, 0);
+    y1 = MIN(y1, dst.height);
+    if (y1 <= y0) return;
+
+    /* Every job owns a horizontal band of destination */
+    ssize_t nbands = CLAMP(1, (ssize_t)ntiles/BATCH_BAND_TILES, nproc);
+    int32_t block = (y1 - y0 + nbands - 1)/nbands;
+    for (int32_t y = y0; y < y1; y += block) {
+        struct do_tiles_arg arg = {
+            dst, {0, y, dst.width, MIN(block, y1 - y)},
+            sets, tiles, ntiles, scale
+        };
+        submit_work(do_tiles, &arg, sizeof arg);
+    }
 }
 
 tile_t tileset_next_tile(struct tileset *set, tile_t tileid) {
@@ -109,22 +576,131 @@ tile_t tileset_next_tile(struct tileset *set, tile_t tileid) {
     return MKTILE(TILESET_ID(tileid), tile->next_frame);
 }
 
-struct tilemap *create_tilemap(size_t width, size_t height, int32_t tile_width, int32_t tile_height, struct tileset **sets, size_t nsets) {
+/* Maps per cell data (tile planes, byte grids and bitsets) from anonymous
+ * file in backing directory. The file has no name (or is unlinked right
+ * away if O_TMPFILE is not supported), it only serves as storage that
+ * can be paged out, so that maps larger than memory can be used. Only
+ * per chunk state, lists and caches are kept in allocated memory */
+static void *map_cells(const char *dir, size_t size) {
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof path, "%s/tilemap.XXXXXX", dir) >= (int)sizeof path) {
+            errno = ENAMETOOLONG;
+        } else if ((fd = mkostemp(path, O_CLOEXEC)) >= 0) {
+            unlink(path);
+        }
+    }
+    if (fd < 0) {
+        warn("Can't create tilemap backing file in '%s': %s", dir, strerror(errno));
+        return NULL;
+    }
+
+    void *addr = MAP_FAILED;
+    if (!ftruncate(fd, size))
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        warn("Can't map tilemap backing file in '%s': %s", dir, strerror(errno));
+    close(fd);
+
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+/* Advises kernel on pages of [start, end), pages partially
+ * outside of the range are prefetched but not released */
+static void advise_range(void *base, size_t start, size_t end, int advice) {
+    uintptr_t from = (uintptr_t)base + start, to = (uintptr_t)base + end;
+    if (advice == MADV_WILLNEED) {
+        from &= ~(uintptr_t)(TILEMAP_PAGE - 1);
+        to = (to + TILEMAP_PAGE - 1) & ~(uintptr_t)(TILEMAP_PAGE - 1);
+    } else {
+        from = (from + TILEMAP_PAGE - 1) & ~(uintptr_t)(TILEMAP_PAGE - 1);
+        to &= ~(uintptr_t)(TILEMAP_PAGE - 1);
+    }
+    if (from < to) madvise((void *)from, to - from, advice);
+}
+
+/* Advises kernel on tile planes and byte grids of rows of chunks [cy0, cy1) */
+static void advise_rows(struct tilemap *map, size_t cy0, size_t cy1, int advice) {
+    size_t start = tilemap_cell_index(map, 0, cy0*TILEMAP_CHUNK);
+    size_t end = cy1 < map->chunks_height ?
+            tilemap_cell_index(map, 0, cy1*TILEMAP_CHUNK) : map->plane_size;
+
+    for (size_t i = 0; i < TILEMAP_LAYERS; i++)
+        advise_range(map->tiles + i*map->plane_size, start*sizeof(uint16_t), end*sizeof(uint16_t), advice);
+    advise_range(map->ticked, start, end, advice);
+    advise_range(map->types, start, end, advice);
+    advise_range(map->shapes, start, end, advice);
+}
+
+/* Prefetches planes of rows of chunks around visible rows [cy0, cy1)
+ * and releases distant ones. Kernel reads pages ahead asynchronously,
+ * so drawing does not wait for disk unless the tiles are needed */
+static void stream_rows(struct tilemap *map, ssize_t cy0, ssize_t cy1) {
+    if (!map->cells_mapped) return;
+
+    ssize_t rows = map->chunks_height;
+    for (ssize_t cy = MAX(0, cy0 - STREAM_PREFETCH); cy < MIN(rows, cy1 + STREAM_PREFETCH); cy++) {
+        if (map->streamed[cy >> 6] & (1ULL << (cy & 63))) continue;
+        map->streamed[cy >> 6] |= 1ULL << (cy & 63);
+        advise_rows(map, cy, cy + 1, MADV_WILLNEED);
+    }
+
+    ssize_t keep0 = MAX(0, cy0 - STREAM_RELEASE), keep1 = MIN(rows, cy1 + STREAM_RELEASE);
+    for (ssize_t k = 0; k < (rows + 63) >> 6; k++) {
+        for (uint64_t bits = map->streamed[k]; bits; bits &= bits - 1) {
+            ssize_t cy = (k << 6) + __builtin_ctzll(bits);
+            if (cy >= keep0 && cy < keep1) continue;
+            map->streamed[k] &= ~(1ULL << (cy & 63));
+            /* Pages are only unmapped, dirty ones stay in page
+             * cache until written back and can be reclaimed after */
+            advise_rows(map, cy, cy + 1, MADV_DONTNEED);
+        }
+    }
+}
+
+struct tilemap *create_tilemap(size_t width, size_t height, int32_t tile_width, int32_t tile_height,
+                               struct tileset **sets, size_t nsets, enum cell_order order, const char *backing) {
     assert(tile_width > 0);
     assert(tile_height > 0);
 
-    size_t dirty_size = ((width + 31) >> 5)*height*sizeof(uint32_t);
-    size_t ticked_size = width * height * sizeof(uint32_t);
-    size_t tiles_size = (width*height*TILEMAP_LAYERS*sizeof(tile_t) + 3) & ~3;
-    struct tilemap *map = calloc(1, sizeof(*map) + 2*dirty_size + tiles_size + ticked_size);
+    size_t chunks_width = (width + TILEMAP_CHUNK - 1)/TILEMAP_CHUNK;
+    size_t chunks_height = (height + TILEMAP_CHUNK - 1)/TILEMAP_CHUNK;
+    size_t stride = (width + 31) & ~31;
+    size_t blocks_width = (width + 7) >> 3;
+    /* Planes are padded so that bitset words never span multiple
+     * rows or multiple blocks and every plane starts on a new page */
+    size_t plane_size = order == order_blocked ?
+            blocks_width*((height + 7) >> 3) << 6 : stride*height;
+    plane_size = (plane_size + TILEMAP_PAGE/sizeof(uint16_t) - 1) & ~(TILEMAP_PAGE/sizeof(uint16_t) - 1);
+    size_t dirty_size = (plane_size >> 5)*sizeof(uint32_t);
+    size_t ticked_size = (plane_size * sizeof(uint8_t) + 3) & ~3;
+    size_t types_size = (plane_size * sizeof(uint8_t) + 3) & ~3;
+    size_t tiles_size = plane_size*TILEMAP_LAYERS*sizeof(uint16_t);
+    size_t listed_size = ((plane_size*TILEMAP_LAYERS + 31) >> 5)*sizeof(uint32_t);
+    /* Tile planes go first to keep them page aligned */
+    size_t cells_size = tiles_size + 2*dirty_size + ticked_size + 2*types_size + listed_size;
+
+    /* Zero filled cells are empty, so neither backing file nor
+     * allocated memory needs to be touched until tiles are set */
+    uint8_t *cells = backing ? map_cells(backing, cells_size) : NULL;
+    struct tilemap *map = calloc(1, sizeof(*map) + (cells ? 0 : cells_size));
     assert(map);
 
-    map->dirty = (uint32_t *)((uint8_t *)map->tiles + tiles_size);
+    map->cells_mapped = cells;
+    if (!cells) cells = (uint8_t *)(map + 1);
+    map->tiles = (uint16_t *)cells;
+    map->dirty = (uint32_t *)(cells + tiles_size);
     map->visited = (uint32_t *)((uint8_t *)map->dirty + dirty_size);
-    map->ticked = (uint32_t *)((uint8_t *)map->visited + dirty_size);
+    map->ticked = (uint8_t *)map->visited + dirty_size;
+    map->types = map->ticked + ticked_size;
+    map->shapes = map->types + types_size;
+    map->animated_listed = (uint32_t *)(map->shapes + types_size);
+    map->cells_size = cells_size;
 
     if (nsets) {
         assert(sets);
+        assert(nsets <= TILEMAP_MAX_SETS);
         map->nsets = nsets;
         map->sets = malloc(nsets*sizeof(*sets));
         for (size_t i = 0; i < nsets; i++) {
@@ -135,15 +711,19 @@ struct tilemap *create_tilemap(size_t width, size_t height, int32_t tile_width,
 
     map->width = width;
     map->height = height;
+    map->order = order;
+    map->stride = stride;
+    map->blocks_width = blocks_width;
+    map->plane_size = plane_size;
     map->tile_width = tile_width;
     map->tile_height = tile_height;
-    map->cbuf = create_image(width*tile_width, height*tile_height);
-
-    image_queue_fill(map->cbuf, (struct rect){0, 0, width*tile_width, height*tile_height}, BG_COLOR);
-    drain_work();
-
-    /* Set every tile to NOTILE */
-    memset(map->tiles, 0xFF, width*height*TILEMAP_LAYERS*sizeof(tile_t));
+    map->chunks_width = chunks_width;
+    map->chunks_height = chunks_height;
+    map->chunks = calloc(chunks_width*chunks_height, sizeof *map->chunks);
+    map->chunk_list = malloc(chunks_width*chunks_height*sizeof *map->chunk_list);
+    map->dirty_chunks = calloc((chunks_width*chunks_height + 63) >> 6, sizeof *map->dirty_chunks);
+    map->streamed = calloc((chunks_height + 63) >> 6, sizeof *map->streamed);
+    assert(map->chunks && map->chunk_list && map->dirty_chunks && map->streamed);
 
     return map;
 }
@@ -153,14 +733,27 @@ void free_tilemap(struct tilemap *map) {
         unref_tileset(map->sets[i]);
     }
     free(map->sets);
-    free_image(&map->cbuf);
+    for (size_t i = 0; i < map->chunks_width*map->chunks_height; i++)
+        if (map->chunks[i].img.data) free_image(&map->chunks[i].img);
+    if (map->zoom.data) free_image(&map->zoom);
+    free(map->chunks);
+    free(map->chunk_list);
+    free(map->dirty_chunks);
+    free(map->animated);
+    free(map->random_pending);
+    free(map->events);
+    free(map->streamed);
+    free(map->journal);
+    if (map->cells_mapped) munmap(map->tiles, map->cells_size);
     free(map);
 }
 
 tile_t tilemap_add_tileset(struct tilemap *map, struct tileset *newset) {
+    assert(map->nsets < TILEMAP_MAX_SETS);
     struct tileset **new = realloc(map->sets, (map->nsets + 1)*sizeof(map->sets[0]));
     if (!new) return 0;
 
+    map->sets = new;
     map->sets[map->nsets] = newset;
     return map->nsets++;
 }
@@ -172,11 +765,6 @@ tile_t tilemap_get_tile(struct tilemap *map, int32_t x, int32_t y, int32_t layer
     return tilemap_get_tile_unsafe(map, x, y, layer);
 }
 
-void tilemap_queue_draw(struct image dst, struct tilemap *map, int32_t x, int32_t y) {
-    image_queue_blt(dst, (struct rect){x, y, map->tile_width*map->width*map->scale, map->tile_height*map->height*map->scale},
-              map->cbuf, (struct rect){0, 0, map->tile_width*map->width, map->tile_height*map->height}, 0);
-}
-
 tile_t tilemap_set_tile(struct tilemap *map, int32_t x, int32_t y, int32_t layer, tile_t tile) {
     assert(x >= 0 && x < (ssize_t)map->width);
     assert(y >= 0 && y < (ssize_t)map->height);
@@ -189,42 +777,670 @@ tile_t tilemap_set_tile(struct tilemap *map, int32_t x, int32_t y, int32_t layer
     return tilemap_set_tile_unsafe(map, x, y, layer, tile);
 }
 
+void tilemap_set_journal(struct tilemap *map, size_t size) {
+    free(map->journal);
+    map->journal = NULL;
+    map->journal_size = 0;
+    /* Changes are not recorded while disabled, so
+     * all existing cursors become overflowed */
+    map->journal_start = ++map->journal_head;
+    if (!size) return;
+
+    size_t pow2 = 1;
+    while (pow2 < size) pow2 <<= 1;
+    map->journal = malloc(pow2*sizeof *map->journal);
+    assert(map->journal);
+    map->journal_size = pow2;
+}
+
+uint64_t tilemap_journal_cursor(struct tilemap *map) {
+    return map->journal_head;
+}
+
+ssize_t tilemap_read_journal(struct tilemap *map, uint64_t *cursor, struct tile_change *changes, size_t n) {
+    if (!map->journal || *cursor < map->journal_start ||
+            map->journal_head - *cursor > map->journal_size) return -1;
+
+    n = MIN(n, map->journal_head - *cursor);
+    for (size_t i = 0; i < n; i++)
+        changes[i] = map->journal[(*cursor + i) & (map->journal_size - 1)];
+    *cursor += n;
+    return n;
+}
+
 void tilemap_set_scale(struct tilemap *map, double scale) {
+    if (map->zoom.data && scale != map->scale) {
+        /* Zoom cache can still be used by queued draws */
+        drain_work();
+        free_image(&map->zoom);
+    }
     map->scale = scale;
 }
 
-bool tilemap_refresh(struct tilemap *map) {
-    if (!map->has_dirty) return 0;
+static struct rect chunk_rect(struct tilemap *map, size_t i) {
+    size_t x = i % map->chunks_width*TILEMAP_CHUNK;
+    size_t y = i / map->chunks_width*TILEMAP_CHUNK;
+    return (struct rect) {
+        x, y, MIN(TILEMAP_CHUNK, map->width - x),
+        MIN(TILEMAP_CHUNK, map->height - y),
+    };
+}
 
-    if (map->fade > 0.001) {
-        image_queue_fill(map->cbuf, (struct rect){0, 0, map->width*map->tile_width,
-            map->height*map->tile_height}, BG_COLOR);
-        drain_work();
+struct word_span {
+    size_t word;
+    int32_t x;
+    int32_t y;
+};
+
+/* Lists bitset words covering cells of the chunk: in linear order every chunk
+ * row is one word, in blocked order every 8x8 block is two words of 8x4 cells.
+ * Bit b of word corresponds to cell x + b, y or x + b % 8, y + b / 8 */
+static size_t chunk_words(struct tilemap *map, struct rect cr, struct word_span spans[static TILEMAP_CHUNK]) {
+    size_t n = 0;
+    if (map->order == order_blocked) {
+        for (int32_t y = cr.y; y < cr.y + cr.height; y += 8) {
+            for (int32_t x = cr.x; x < cr.x + cr.width; x += 8) {
+                size_t word = tilemap_cell_index(map, x, y) >> 5;
+                spans[n++] = (struct word_span){word, x, y};
+                spans[n++] = (struct word_span){word + 1, x, y + 4};
+            }
+        }
+    } else {
+        for (int32_t y = cr.y; y < cr.y + cr.height; y++)
+            spans[n++] = (struct word_span){tilemap_cell_index(map, cr.x, y) >> 5, cr.x, y};
     }
+    return n;
+}
+
+/* Bits [from, to) of a word */
+inline static uint32_t bit_range(int32_t from, int32_t to) {
+    uint32_t hi = to >= 32 ? UINT32_MAX : to <= 0 ? 0 : (1U << to) - 1;
+    uint32_t lo = from >= 32 ? UINT32_MAX : from <= 0 ? 0 : (1U << from) - 1;
+    return hi & ~lo;
+}
+
+/* Bits of the span word corresponding to cells inside of the view */
+static uint32_t span_mask(struct tilemap *map, struct word_span sp, struct rect view) {
+    uint32_t cols = bit_range(view.x - sp.x, view.x + view.width - sp.x);
+    if (map->order != order_blocked)
+        return sp.y >= view.y && sp.y < view.y + view.height ? cols : 0;
+
+    uint32_t rows = bit_range(view.y - sp.y, view.y + view.height - sp.y), mask = 0;
+    for (int32_t i = 0; i < 4; i++)
+        if (rows & (1U << i)) mask |= (cols & 0xFF) << 8*i;
+    return mask;
+}
+
+/* Recomputes types of cells of the rectangle
+ * and shapes of them and of their neighbours */
+static void update_types(struct tilemap *map, struct rect r) {
+    for (int32_t y = r.y; y < r.y + r.height; y++) {
+        for (int32_t x = r.x; x < r.x + r.width; x++) {
+            size_t cell = tilemap_cell_index(map, x, y);
+            char type = VOID;
+            for (size_t i = TILEMAP_TYPE_LAYERS; i-- > 0 && type == VOID; ) {
+                tile_t tile = load_tile(map->tiles[i*map->plane_size + cell]);
+                if (tile != NOTILE) type = TILE_TYPE_CHAR(map->sets[TILESET_ID(tile)]->tiles[TILE_ID(tile)].type);
+            }
+            map->types[cell] = type ^ VOID;
+        }
+    }
+
+    struct rect sr = {r.x - 1, r.y - 1, r.width + 2, r.height + 2};
+    intersect_with(&sr, &(struct rect){0, 0, map->width, map->height});
+    for (int32_t y = sr.y; y < sr.y + sr.height; y++) {
+        for (int32_t x = sr.x; x < sr.x + sr.width; x++) {
+            char type = tilemap_cell_type(map, x, y);
+            uint8_t shape = 0;
+            if (tilemap_cell_type(map, x, y + 1) != type) shape |= TILEMAP_SHAPE_OPEN_BELOW;
+            if (tilemap_cell_type(map, x - 1, y) != VOID) shape |= TILEMAP_SHAPE_SOLID_LEFT;
+            if (tilemap_cell_type(map, x + 1, y) != VOID) shape |= TILEMAP_SHAPE_SOLID_RIGHT;
+            map->shapes[tilemap_cell_index(map, x, y)] = shape;
+        }
+    }
+}
+
+void tilemap_set_rect(struct tilemap *map, struct rect rect, int32_t layer, const tile_t *tiles, size_t stride) {
+    assert(rect.x >= 0 && rect.width >= 0 && rect.x + rect.width <= (ssize_t)map->width);
+    assert(rect.y >= 0 && rect.height >= 0 && rect.y + rect.height <= (ssize_t)map->height);
+    assert(layer >= 0 && layer < TILEMAP_LAYERS);
+    if (!rect.width || !rect.height) return;
+
+    /* Tileset ids are checked for the whole row at once, NOTILE
+     * wraps to zero and every valid tile is below the limit */
+    uint32_t limit = MKTILE((uint32_t)map->nsets, 0);
+    uint16_t *plane = map->tiles + layer*map->plane_size;
+    for (int32_t y = 0; y < rect.height; y++) {
+        const tile_t *row = tiles + y*stride;
+        uint32_t bad = 0;
+        for (int32_t x = 0; x < rect.width; x++)
+            bad |= row[x] + 1 > limit;
+        assert(!bad);
+
+        /* Cells of the row are contiguous in linear order
+         * and in runs of up to 8 cells in blocked order */
+        for (int32_t x = 0, run; x < rect.width; x += run) {
+            run = map->order == order_blocked ? MIN(8 - ((rect.x + x) & 7), rect.width - x) : rect.width - x;
+            uint16_t *dst = plane + tilemap_cell_index(map, rect.x + x, rect.y + y);
+            if (map->journal) {
+                for (int32_t i = 0; i < run; i++)
+                    if (load_tile(dst[i]) != row[x + i])
+                        journal_change(map, rect.x + x + i, rect.y + y, layer, load_tile(dst[i]), row[x + i]);
+            }
+            for (int32_t i = 0; i < run; i++)
+                dst[i] = store_tile(row[x + i]);
+        }
+
+        for (int32_t x = 0; x < rect.width; x++) {
+            if (row[x] == NOTILE) continue;
+            struct tileset *set = map->sets[TILESET_ID(row[x])];
+            assert(TILE_ID(row[x]) < set->ntiles);
+
+            uint32_t type = set->tiles[TILE_ID(row[x])].type;
+            if (!(type & (TILE_TYPE_ANIMATED | TILE_TYPE_RANDOM))) continue;
+
+            size_t idx = layer*map->plane_size + tilemap_cell_index(map, rect.x + x, rect.y + y);
+            if ((type & (TILE_TYPE_ANIMATED | TILE_TYPE_RANDOM)) == TILE_TYPE_ANIMATED &&
+                    !(map->animated_listed[idx >> 5] & (1U << (idx & 31))))
+                list_animated(map, idx);
+            if (!layer && (type & TILE_TYPE_RANDOM))
+                list_random(map, idx);
+        }
+    }
+
+    /* Dirty bits are set word by word for every chunk */
+    struct word_span spans[TILEMAP_CHUNK];
+    for (size_t cy = rect.y/TILEMAP_CHUNK; cy <= (size_t)(rect.y + rect.height - 1)/TILEMAP_CHUNK; cy++) {
+        map->streamed[cy >> 6] |= 1ULL << (cy & 63);
+        for (size_t cx = rect.x/TILEMAP_CHUNK; cx <= (size_t)(rect.x + rect.width - 1)/TILEMAP_CHUNK; cx++) {
+            size_t chunk = cy*map->chunks_width + cx;
+            size_t nspans = chunk_words(map, chunk_rect(map, chunk), spans);
+            for (size_t j = 0; j < nspans; j++)
+                map->dirty[spans[j].word] |= span_mask(map, spans[j], rect);
+            map->dirty_chunks[chunk >> 6] |= 1ULL << (chunk & 63);
+        }
+    }
+    map->has_dirty = 1;
+
+    if (layer < TILEMAP_TYPE_LAYERS)
+        update_types(map, rect);
+}
+
+struct do_render_arg {
+    struct tilemap *map;
+    size_t chunk;
+    /* Band of chunk tile rows */
+    int32_t y0;
+    int32_t y1;
+    /* Render from scratch instead of drawing dirty tiles on top */
+    bool all;
+    /* Only dirty tiles inside of the view are drawn on top */
+    struct rect view;
+};
+
+/* Renders visited tiles of the band of the chunk (all of them or only
+ * dirty ones). All layers are drawn by the same job in order, so bands
+ * are independent and no barriers between layers are needed */
+static void do_render_band(void *varg) {
+    struct do_render_arg *arg = varg;
+    struct tilemap *map = arg->map;
+    struct image img = map->chunks[arg->chunk].img;
+    struct rect cr = chunk_rect(map, arg->chunk);
+    struct rect band = {0, arg->y0*map->tile_height, img.width, (arg->y1 - arg->y0)*map->tile_height};
+    bool blocked = map->order == order_blocked;
+    uint64_t written = 0;
+
+    if (arg->all)
+        written += image_fill(img, band, BG_COLOR);
+
+    struct word_span spans[TILEMAP_CHUNK];
+    uint32_t masks[TILEMAP_CHUNK];
+    size_t nspans = chunk_words(map, (struct rect){cr.x, cr.y + arg->y0, cr.width, arg->y1 - arg->y0}, spans);
+    for (size_t k = 0; k < nspans; k++) {
+        masks[k] = arg->all ? UINT32_MAX : map->dirty[spans[k].word];
+        if (!arg->all) masks[k] &= span_mask(map, spans[k], arg->view);
+    }
+
     for (size_t i = 0; i < TILEMAP_LAYERS; i++) {
-        for (size_t yi = 0; yi < map->height; yi++) {
-            for (size_t xi = 0; xi < map->width; xi++) {
-                if (get_dirty(map, xi, yi) && get_visited(map, xi, yi)) {
-                    tile_t tile = tilemap_get_tile_unsafe(map, xi, yi, i);
-                    if (tile == NOTILE) continue;
-                    tileset_queue_tile(map->cbuf, map->sets[TILESET_ID(tile)],
-                                       TILE_ID(tile), xi*map->tile_width, yi*map->tile_height, 1);
-                }
+        for (size_t k = 0; k < nspans; k++) {
+            uint32_t bits = map->visited[spans[k].word] & masks[k];
+            while (bits) {
+                int32_t b = __builtin_ctz(bits);
+                bits &= bits - 1;
+                tile_t tile = load_tile(map->tiles[i*map->plane_size + (spans[k].word << 5) + b]);
+                if (tile == NOTILE) continue;
+
+                struct tileset *set = map->sets[TILESET_ID(tile)];
+                struct tile *tl = &set->tiles[TILE_ID(tile)];
+                struct rect drect = {
+                    (spans[k].x + (blocked ? b & 7 : b) - cr.x)*map->tile_width,
+                    (spans[k].y + (blocked ? b >> 3 : 0) - cr.y)*map->tile_height,
+                    tl->pos.width, tl->pos.height,
+                };
+                written += image_blt_clip(img, band, drect, set->img, tl->pos, sample_nearest, blend_over);
             }
         }
+    }
+
+    __atomic_add_fetch(&image_stats.pixels_written, written, __ATOMIC_RELAXED);
+}
+
+/* Renders listed chunks, chunks are split into bands
+ * so that there are enough jobs to occupy every thread */
+static void render_chunks(struct tilemap *map, size_t nlist, bool all, struct rect view) {
+    if (!nlist) return;
+
+    /* Bands are multiples of 8 rows to cover whole blocks */
+    int32_t nbands = CLAMP(1, (nproc + (ssize_t)nlist - 1)/(ssize_t)nlist, TILEMAP_CHUNK/8);
+    int32_t rows = ((TILEMAP_CHUNK + nbands - 1)/nbands + 7) & ~7;
+    for (size_t j = 0; j < nlist; j++) {
+        struct rect cr = chunk_rect(map, map->chunk_list[j]);
+        for (int32_t y = 0; y < cr.height; y += rows) {
+            struct do_render_arg arg = {map, map->chunk_list[j], y, MIN(y + rows, cr.height), all, view};
+            submit_work(do_render_band, &arg, sizeof arg);
+        }
+    }
+    drain_work();
+}
+
+static void unlink_chunk(struct tilemap *map, size_t i) {
+    struct map_chunk *chunk = &map->chunks[i];
+    if (chunk->prev) map->chunks[chunk->prev - 1].next = chunk->next;
+    else map->lru_head = chunk->next;
+    if (chunk->next) map->chunks[chunk->next - 1].prev = chunk->prev;
+    else map->lru_tail = chunk->prev;
+    chunk->prev = chunk->next = 0;
+}
+
+/* Moves resident chunk to the front of the list */
+static void touch_chunk(struct tilemap *map, size_t i) {
+    struct map_chunk *chunk = &map->chunks[i];
+    if (map->lru_head == i + 1) return;
+    /* Linked chunk not in front always has previous one */
+    if (chunk->prev) unlink_chunk(map, i);
+    chunk->next = map->lru_head;
+    if (map->lru_head) map->chunks[map->lru_head - 1].prev = i + 1;
+    else map->lru_tail = i + 1;
+    map->lru_head = i + 1;
+}
+
+static void evict_chunks(struct tilemap *map, size_t size) {
+    while (map->resident_size + size > MAP_CACHE_BUDGET && map->lru_tail) {
+        /* Chunks needed by current draw are all
+         * in front of the least recently drawn one */
+        size_t i = map->lru_tail - 1;
+        struct map_chunk *lru = &map->chunks[i];
+        if (lru->last_used == map->clock) break;
+
+        unlink_chunk(map, i);
+        map->resident_size -= ((lru->img.width + 3) & ~3)*lru->img.height*sizeof(color_t);
+        free_image(&lru->img);
+    }
+}
+
+/* Makes listed chunks resident and renders them from scratch */
+static void load_chunks(struct tilemap *map, size_t nlist) {
+    /* Chunks queued for drawing before can be evicted */
+    drain_work();
+
+    for (size_t j = 0; j < nlist; j++) {
+        struct rect cr = chunk_rect(map, map->chunk_list[j]);
+        int32_t width = cr.width*map->tile_width, height = cr.height*map->tile_height;
+        size_t size = ((width + 3) & ~3)*height*sizeof(color_t);
+
+        evict_chunks(map, size);
+        map->chunks[map->chunk_list[j]].img = create_image(width, height);
+        touch_chunk(map, map->chunk_list[j]);
+        map->resident_size += size;
+    }
+
+    render_chunks(map, nlist, 1, (struct rect){0});
+}
+
+void tilemap_set_immediate(struct tilemap *map, bool immediate) {
+    if (immediate && !map->immediate) {
+        /* Cache is not used in immediate mode */
         drain_work();
+        for (size_t i = 0; i < map->chunks_width*map->chunks_height; i++) {
+            if (map->chunks[i].img.data) free_image(&map->chunks[i].img);
+            map->chunks[i].prev = map->chunks[i].next = 0;
+        }
+        if (map->zoom.data) free_image(&map->zoom);
+        map->lru_head = map->lru_tail = 0;
+        map->resident_size = 0;
     }
+    map->immediate = immediate;
+}
+
+struct do_draw_arg {
+    struct image dst;
+    struct tilemap *map;
+    /* Band of destination image */
+    struct rect band;
+    int32_t x;
+    int32_t y;
+};
+
+/* Draws visited tiles intersecting the band straight from tilesets */
+static void do_draw_band(void *varg) {
+    struct do_draw_arg *arg = varg;
+    struct tilemap *map = arg->map;
+    struct rect band = arg->band;
+    double tile_width = map->tile_width*map->scale;
+    double tile_height = map->tile_height*map->scale;
+    uint64_t written = image_fill(arg->dst, band, BG_COLOR);
+
+    /* Tiles can be larger than cells, so one more cell to
+     * the left and above is checked for overlapping the band */
+    int32_t cx0 = MAX(0, (int32_t)floor((band.x - arg->x)/tile_width) - 1);
+    int32_t cy0 = MAX(0, (int32_t)floor((band.y - arg->y)/tile_height) - 1);
+    int32_t cx1 = MIN((int32_t)map->width, (int32_t)ceil((band.x + band.width - arg->x)/tile_width));
+    int32_t cy1 = MIN((int32_t)map->height, (int32_t)ceil((band.y + band.height - arg->y)/tile_height));
+
+    for (size_t i = 0; i < TILEMAP_LAYERS; i++) {
+        for (int32_t cy = cy0; cy < cy1; cy++) {
+            for (int32_t cx = cx0; cx < cx1; cx++) {
+                size_t cell = tilemap_cell_index(map, cx, cy);
+                if (!(map->visited[cell >> 5] & (1U << (cell & 31)))) continue;
+                tile_t tile = load_tile(map->tiles[i*map->plane_size + cell]);
+                if (tile == NOTILE) continue;
+
+                struct tileset *set = map->sets[TILESET_ID(tile)];
+                struct tile *tl = &set->tiles[TILE_ID(tile)];
+                /* Edges are rounded the same way for every
+                 * tile, so that there are no gaps between them */
+                int32_t x0 = arg->x + (int32_t)(cx*tile_width), y0 = arg->y + (int32_t)(cy*tile_height);
+                struct rect drect = {
+                    x0, y0,
+                    arg->x + (int32_t)((cx*map->tile_width + tl->pos.width)*map->scale) - x0,
+                    arg->y + (int32_t)((cy*map->tile_height + tl->pos.height)*map->scale) - y0,
+                };
+                written += image_blt_clip(arg->dst, band, drect, set->img, tl->pos, sample_nearest, blend_over);
+            }
+        }
+    }
+
+    if (map->fade > 0.001)
+        written += image_fill(arg->dst, band, color_apply_a(BG_COLOR, map->fade));
+
+    __atomic_add_fetch(&image_stats.pixels_written, written, __ATOMIC_RELAXED);
+}
+
+/* Splits visible part into horizontal bands, one job per band */
+static void draw_immediate(struct image dst, struct rect vis, struct tilemap *map, int32_t x, int32_t y) {
+    int32_t rows = MAX(1, (vis.height + nproc - 1)/nproc);
+    for (int32_t y0 = vis.y; y0 < vis.y + vis.height; y0 += rows) {
+        struct rect band = {vis.x, y0, vis.width, MIN(rows, vis.y + vis.height - y0)};
+        struct do_draw_arg arg = {dst, map, band, x, y};
+        submit_work(do_draw_band, &arg, sizeof arg);
+    }
+}
+
+struct do_fade_arg {
+    struct image dst;
+    struct image src;
+    struct rect band;
+    struct rect drect;
+    color_t color;
+};
+
+/* Copies the band of the zoom cache and fades it while
+ * it is still in cache, instead of fading rendered chunks */
+static void do_fade_band(void *varg) {
+    struct do_fade_arg *arg = varg;
+    uint64_t written = image_blt_clip(arg->dst, arg->band, arg->drect, arg->src,
+                                      (struct rect){0, 0, arg->drect.width, arg->drect.height}, 0, blend_copy);
+    written += image_fill(arg->dst, arg->band, arg->color);
+    __atomic_add_fetch(&image_stats.pixels_written, written, __ATOMIC_RELAXED);
+}
+
+/* Splits faded part into horizontal bands, one job per band */
+static void draw_faded(struct image dst, struct rect clip, struct rect drect, struct tilemap *map) {
+    struct rect vis = drect;
+    if (!intersect_with(&vis, &clip) ||
+        !intersect_with(&vis, &(struct rect){0, 0, dst.width, dst.height})) return;
+
+    color_t color = color_apply_a(BG_COLOR, map->fade);
+    int32_t rows = MAX(1, (vis.height + nproc - 1)/nproc);
+    for (int32_t y0 = vis.y; y0 < vis.y + vis.height; y0 += rows) {
+        struct rect band = {vis.x, y0, vis.width, MIN(rows, vis.y + vis.height - y0)};
+        struct do_fade_arg arg = {dst, map->zoom, band, drect, color};
+        submit_work(do_fade_band, &arg, sizeof arg);
+    }
+}
+
+/* Scaled rectangle of the chunk relative to the map origin,
+ * edges are rounded the same way for neighbouring chunks */
+static struct rect scaled_chunk_rect(struct tilemap *map, size_t i) {
+    struct rect cr = chunk_rect(map, i);
+    double tile_width = map->tile_width*map->scale;
+    double tile_height = map->tile_height*map->scale;
+    int32_t x0 = cr.x*tile_width, y0 = cr.y*tile_height;
+    return (struct rect) {
+        x0, y0,
+        (int32_t)((cr.x + cr.width)*tile_width) - x0,
+        (int32_t)((cr.y + cr.height)*tile_height) - y0,
+    };
+}
+
+/* Scales chunks into the part of zoom cache image covering zr */
+static void fill_zoom(struct tilemap *map, struct image zoom, struct rect zr, struct rect part) {
+    double chunk_width = TILEMAP_CHUNK*map->tile_width*map->scale;
+    double chunk_height = TILEMAP_CHUNK*map->tile_height*map->scale;
+    ssize_t cx0 = MAX(0, floor((zr.x + part.x)/chunk_width));
+    ssize_t cy0 = MAX(0, floor((zr.y + part.y)/chunk_height));
+    ssize_t cx1 = MIN((ssize_t)map->chunks_width, ceil((zr.x + part.x + part.width)/chunk_width));
+    ssize_t cy1 = MIN((ssize_t)map->chunks_height, ceil((zr.y + part.y + part.height)/chunk_height));
+
+    for (ssize_t cy = cy0; cy < cy1; cy++) {
+        for (ssize_t cx = cx0; cx < cx1; cx++) {
+            struct image img = map->chunks[cy*map->chunks_width + cx].img;
+            if (!img.data) continue;
+
+            struct rect drect = scaled_chunk_rect(map, cy*map->chunks_width + cx);
+            drect.x -= zr.x, drect.y -= zr.y;
+            image_queue_blt_clip(zoom, part, drect, img, (struct rect){0, 0, img.width, img.height}, 0, blend_copy);
+        }
+    }
+}
+
+/* Rectangle of whole cells covering the needed part and the margin */
+static struct rect zoom_rect(struct tilemap *map, struct rect need) {
+    double tile_width = map->tile_width*map->scale;
+    double tile_height = map->tile_height*map->scale;
+    int32_t x0 = MAX(0, floor((need.x - ZOOM_MARGIN)/tile_width));
+    int32_t y0 = MAX(0, floor((need.y - ZOOM_MARGIN)/tile_height));
+    int32_t x1 = MIN((int32_t)map->width, ceil((need.x + need.width + ZOOM_MARGIN)/tile_width));
+    int32_t y1 = MIN((int32_t)map->height, ceil((need.y + need.height + ZOOM_MARGIN)/tile_height));
+    return (struct rect) {
+        x0*tile_width, y0*tile_height,
+        (int32_t)(x1*tile_width) - (int32_t)(x0*tile_width),
+        (int32_t)(y1*tile_height) - (int32_t)(y0*tile_height),
+    };
+}
+
+/* Marks chunks under the zoom rectangle as used, so they are
+ * never evicted while cached, and makes them resident */
+static void use_chunks(struct tilemap *map, struct rect zr) {
+    double chunk_width = TILEMAP_CHUNK*map->tile_width*map->scale;
+    double chunk_height = TILEMAP_CHUNK*map->tile_height*map->scale;
+    ssize_t cx0 = MAX(0, floor(zr.x/chunk_width));
+    ssize_t cy0 = MAX(0, floor(zr.y/chunk_height));
+    ssize_t cx1 = MIN((ssize_t)map->chunks_width, ceil((zr.x + zr.width)/chunk_width));
+    ssize_t cy1 = MIN((ssize_t)map->chunks_height, ceil((zr.y + zr.height)/chunk_height));
+
+    map->clock++;
+
+    size_t n = 0;
+    for (ssize_t cy = cy0; cy < cy1; cy++) {
+        for (ssize_t cx = cx0; cx < cx1; cx++) {
+            struct map_chunk *chunk = &map->chunks[cy*map->chunks_width + cx];
+            chunk->last_used = map->clock;
+            if (!chunk->img.data) map->chunk_list[n++] = cy*map->chunks_width + cx;
+            else touch_chunk(map, cy*map->chunks_width + cx);
+        }
+    }
+    if (n) load_chunks(map, n);
+}
+
+/* Moves zoom cache to the new rectangle, the part that
+ * is already scaled is copied and only the rest is scaled */
+static void move_zoom(struct tilemap *map, struct rect zr) {
+    struct image zoom = create_image(zr.width, zr.height);
+    struct rect keep = map->zoom_rect;
+    if (map->zoom.data && intersect_with(&keep, &zr)) {
+        struct rect old = map->zoom_rect;
+        image_queue_blt_clip(zoom, (struct rect){0, 0, zr.width, zr.height},
+                             (struct rect){old.x - zr.x, old.y - zr.y, old.width, old.height},
+                             map->zoom, (struct rect){0, 0, old.width, old.height}, 0, blend_copy);
+
+        /* Strips above, below, to the left and to the right of the kept part */
+        keep.x -= zr.x, keep.y -= zr.y;
+        struct rect strips[] = {
+            {0, 0, zr.width, keep.y},
+            {0, keep.y + keep.height, zr.width, zr.height - keep.y - keep.height},
+            {0, keep.y, keep.x, keep.height},
+            {keep.x + keep.width, keep.y, zr.width - keep.x - keep.width, keep.height},
+        };
+        for (size_t i = 0; i < LEN(strips); i++)
+            if (strips[i].width > 0 && strips[i].height > 0)
+                fill_zoom(map, zoom, zr, strips[i]);
+    } else {
+        fill_zoom(map, zoom, zr, (struct rect){0, 0, zr.width, zr.height});
+    }
+
+    drain_work();
+    if (map->zoom.data) free_image(&map->zoom);
+    map->zoom = zoom;
+    map->zoom_rect = zr;
+}
+
+void tilemap_queue_draw(struct image dst, struct rect clip, struct tilemap *map, int32_t x, int32_t y) {
+    double chunk_height = TILEMAP_CHUNK*map->tile_height*map->scale;
+
+    struct rect vis = {x, y, map->tile_width*map->width*map->scale, map->tile_height*map->height*map->scale};
+    struct rect bounds = {0, 0, dst.width, dst.height};
+    if (!intersect_with(&vis, &clip) || !intersect_with(&vis, &bounds)) return;
+
+    /* Planes are streamed around visible rows of chunks */
+    ssize_t cy0 = MAX(0, floor((vis.y - y)/chunk_height));
+    ssize_t cy1 = MIN((ssize_t)map->chunks_height, ceil((vis.y + vis.height - y)/chunk_height));
+
+    stream_rows(map, cy0, cy1);
+    if (map->immediate) {
+        draw_immediate(dst, vis, map, x, y);
+        return;
+    }
+
+    /* Zoom cache covers the whole visible part of the map,
+     * not only the clipped one, so that it is not moved
+     * between parts of the same frame */
+    struct rect need = {x, y, map->tile_width*map->width*map->scale, map->tile_height*map->height*map->scale};
+    if (!intersect_with(&need, &bounds)) return;
+    need.x -= x, need.y -= y;
+
+    struct rect zr = map->zoom_rect;
+    if (!map->zoom.data || need.x < zr.x || need.y < zr.y ||
+            need.x + need.width > zr.x + zr.width || need.y + need.height > zr.y + zr.height)
+        zr = zoom_rect(map, need);
+
+    use_chunks(map, zr);
+    if (!map->zoom.data || memcmp(&zr, &map->zoom_rect, sizeof zr))
+        move_zoom(map, zr);
+
+    /* Zoom cache is always opaque since chunks are cleared with background color */
+    struct rect drect = {x + zr.x, y + zr.y, zr.width, zr.height};
     if (map->fade > 0.001) {
-        image_queue_fill(map->cbuf, (struct rect){0, 0, map->width*map->tile_width,
-            map->height*map->tile_height}, color_apply_a(BG_COLOR, map->fade));
-        drain_work();
+        draw_faded(dst, clip, drect, map);
+        return;
     }
-    map->has_dirty = 0;
-    size_t dirty_size = ((map->width + 31) >> 5)*map->height*sizeof(uint32_t);
-    memset(map->dirty, 0, dirty_size);
+    image_queue_blt_clip(dst, clip, drect, map->zoom, (struct rect){0, 0, zr.width, zr.height}, 0, blend_copy);
+}
+
+/* Scales cells [x0, x1) x [y0, y1) into zoom cache, one more pixel
+ * around is updated since nearest sampling of neighbouring cell
+ * can pick its pixels. Returns true if anything was queued */
+static bool update_zoom(struct tilemap *map, int32_t x0, int32_t y0, int32_t x1, int32_t y1) {
+    double tile_width = map->tile_width*map->scale;
+    double tile_height = map->tile_height*map->scale;
+    struct rect zr = map->zoom_rect;
+    struct rect part = {
+        (int32_t)(x0*tile_width) - zr.x - 1,
+        (int32_t)(y0*tile_height) - zr.y - 1,
+        (int32_t)(x1*tile_width) - (int32_t)(x0*tile_width) + 2,
+        (int32_t)(y1*tile_height) - (int32_t)(y0*tile_height) + 2,
+    };
+    if (!intersect_with(&part, &(struct rect){0, 0, zr.width, zr.height})) return 0;
+
+    fill_zoom(map, map->zoom, zr, part);
     return 1;
 }
 
+bool tilemap_refresh(struct tilemap *map, struct rect view) {
+    if (!map->has_dirty) return 0;
+
+    size_t nchunks = map->chunks_width*map->chunks_height;
+    if (!intersect_with(&view, &(struct rect){0, 0, map->width, map->height}))
+        view = (struct rect){0};
+
+    /* Only dirty resident chunks inside of the view are rendered, chunks
+     * that are not resident are rendered from scratch when drawn */
+    size_t n = 0;
+    for (size_t k = 0; k < (nchunks + 63) >> 6; k++) {
+        for (uint64_t bits = map->dirty_chunks[k]; bits; bits &= bits - 1) {
+            size_t i = (k << 6) + __builtin_ctzll(bits);
+            struct rect cr = chunk_rect(map, i);
+            if (map->chunks[i].img.data && intersect_with(&cr, &view))
+                map->chunk_list[n++] = i;
+        }
+    }
+
+    render_chunks(map, n, 0, view);
+
+    /* Clear tile bits that were rendered, dirty tiles outside
+     * of the view are kept until the view reaches them */
+    bool has_dirty = 0, in_view = 0, zoomed = 0;
+    struct word_span spans[TILEMAP_CHUNK];
+    for (size_t k = 0; k < (nchunks + 63) >> 6; k++) {
+        for (uint64_t bits = map->dirty_chunks[k]; bits; bits &= bits - 1) {
+            size_t i = (k << 6) + __builtin_ctzll(bits);
+            struct rect cr = chunk_rect(map, i);
+            size_t nspans = chunk_words(map, cr, spans);
+            bool all = !map->chunks[i].img.data;
+
+            /* Zoom cache is updated from rendered tiles */
+            bool zoom = map->zoom.data && !all && intersect_with(&cr, &view);
+
+            uint32_t left = 0;
+            for (size_t j = 0; j < nspans; j++) {
+                uint32_t mask = span_mask(map, spans[j], view);
+                uint32_t drawn = map->dirty[spans[j].word] & mask;
+                if (zoom && drawn && map->order == order_blocked) {
+                    /* Rows of a blocked word are not told apart */
+                    zoomed |= update_zoom(map, spans[j].x, spans[j].y, spans[j].x + 8, spans[j].y + 4);
+                } else if (zoom) {
+                    /* Runs of consecutive rendered tiles */
+                    for (uint32_t run = drawn; run; ) {
+                        int32_t b = __builtin_ctz(run);
+                        int32_t len = run >> b == UINT32_MAX ? 32 : __builtin_ctz(~(run >> b));
+                        run &= b + len >= 32 ? 0 : ~0U << (b + len);
+                        zoomed |= update_zoom(map, spans[j].x + b, spans[j].y, spans[j].x + b + len, spans[j].y + 1);
+                    }
+                }
+                in_view |= drawn != 0;
+                left |= map->dirty[spans[j].word] &= all ? 0 : ~mask;
+            }
+
+            if (left) has_dirty = 1;
+            else map->dirty_chunks[k] &= ~(1ULL << (i & 63));
+        }
+    }
+    if (zoomed) drain_work();
+
+    map->has_dirty = has_dirty;
+    return in_view;
+}
+
 uint32_t tilemap_get_tiletype(struct tilemap *map, int32_t x, int32_t y, int32_t layer) {
     uint32_t tileid = tilemap_get_tile(map, x, y, layer);
     if (tileid == NOTILE) return VOID;
@@ -234,54 +1450,140 @@ uint32_t tilemap_get_tiletype(struct tilemap *map, int32_t x, int32_t y, int32_t
 }
 
 void tilemap_animation_tick(struct tilemap *map) {
-    for (size_t yi = 0; yi < map->height; yi++) {
-        for (size_t xi = 0; xi < map->width; xi++) {
-            for (size_t zi = 0; zi < TILEMAP_LAYERS; zi++) {
-                tile_t tileid = tilemap_get_tile_unsafe(map, xi, yi, zi);
-                if (tileid == NOTILE) continue;
-                tile_t next = tileset_next_tile(map->sets[TILESET_ID(tileid)], tileid);
-                if (next != tileid) tilemap_set_tile_unsafe(map, xi, yi, zi, next);
-            }
+    size_t n = 0;
+    for (size_t i = 0; i < map->animated_count; i++) {
+        uint32_t idx = map->animated[i];
+        tile_t tileid = load_tile(map->tiles[idx]);
+        tile_t next = tileid == NOTILE ? NOTILE :
+                tileset_next_tile(map->sets[TILESET_ID(tileid)], tileid);
+        if (next == tileid) {
+            map->animated_listed[idx >> 5] &= ~(1U << (idx & 31));
+            continue;
         }
+
+        int32_t x, y;
+        cell_pos(map, idx % map->plane_size, &x, &y);
+        tilemap_set_tile_unsafe(map, x, y, idx / map->plane_size, next);
+        map->animated[n++] = idx;
     }
+    map->animated_count = n;
 }
 
 void tilemap_fade(struct tilemap *map, double val) {
-    double old_fade = map->fade;
+    /* Fade is applied when the map is drawn, so
+     * rendered chunks are not affected by it */
+    map->fade = val;
+}
 
-    if ((map->fade = val) <= 0.001 && old_fade > 0.001) {
-        image_queue_fill(map->cbuf, (struct rect){0, 0, map->width*map->tile_width,
-            map->height*map->tile_height}, BG_COLOR);
-        drain_work();
+/* Number of failed checks before the first successful one,
+ * when every check succeeds with probability 1/(div + 1) */
+static uint32_t random_delay(unsigned *seed, uint32_t div) {
+    if (!div) return 0;
+    double u = (rand_r(seed) + 1.)/((double)RAND_MAX + 1.);
+    double k = floor(log(u)/log1p(-1./(div + 1)));
+    return MIN(k, MAX_RANDOM_DELAY);
+}
+
+/* Level l of timing wheel holds events whose due tick differs
+ * from the current one only starting from bits [l*6, l*6 + 6),
+ * so slots are cascaded down when the lower bits wrap around */
+static void wheel_insert(struct tilemap *map, uint32_t id) {
+    struct tick_event *ev = &map->events[id - 1];
+    uint32_t diff = ev->due ^ map->tick;
+    size_t level = diff ? (31 - __builtin_clz(diff))/TILEMAP_WHEEL_BITS : 0;
+    uint32_t *slot = &map->wheel[level][(ev->due >> level*TILEMAP_WHEEL_BITS) & (TILEMAP_WHEEL_SLOTS - 1)];
+    ev->next = *slot;
+    *slot = id;
+}
+
+static void schedule_random(struct tilemap *map, uint32_t cell, uint32_t due, bool cooldown) {
+    uint32_t id = map->events_free;
+    if (id) {
+        map->events_free = map->events[id - 1].next;
+    } else {
+        if (map->events_count + 1 > map->events_caps) {
+            size_t newcaps = 3*map->events_caps/2 + 64;
+            struct tick_event *new = realloc(map->events, newcaps*sizeof *new);
+            assert(new);
+            map->events = new;
+            map->events_caps = newcaps;
+        }
+        id = ++map->events_count;
     }
 
-    map->has_dirty = 1;
-    size_t dirty_size = ((map->width + 31) >> 5)*map->height*sizeof(uint32_t);
-    memset(map->dirty, 0xFF, dirty_size);
+    /* New generation invalidates previously scheduled events */
+    uint8_t state = ((map->ticked[cell] + 1) & RANDOM_GEN_MASK) | (cooldown ? RANDOM_COOLDOWN : 0);
+    map->ticked[cell] = state;
+    map->events[id - 1] = (struct tick_event){cell, due, 0, state};
+    wheel_insert(map, id);
+}
+
+inline static struct tile *get_random_tile(struct tilemap *map, uint32_t cell) {
+    tile_t tileid = load_tile(map->tiles[cell]);
+    if (tileid == NOTILE) return NULL;
+
+    struct tile *tile = &map->sets[TILESET_ID(tileid)]->tiles[TILE_ID(tileid)];
+    return tile->type & TILE_TYPE_RANDOM ? tile : NULL;
 }
 
 void tilemap_random_tick(struct tilemap *map, unsigned *seed) {
-    for (size_t yi = 0; yi < map->height; yi++) {
-        for (size_t xi = 0; xi < map->width; xi++) {
-            tile_t tileid = tilemap_get_tile_unsafe(map, xi, yi, 0);
-            if (tileid == NOTILE) continue;
-
-            // Handle random tick delay
-            if (map->ticked[map->width*yi + xi]) {
-                map->ticked[map->width*yi + xi]--;
+    uint32_t now = map->tick;
+
+    /* Cascade higher levels first, so that
+     * events can move down several levels */
+    for (size_t l = TILEMAP_WHEEL_LEVELS - 1; l > 0; l--) {
+        if (now & ((1U << l*TILEMAP_WHEEL_BITS) - 1)) continue;
+        uint32_t *slot = &map->wheel[l][(now >> l*TILEMAP_WHEEL_BITS) & (TILEMAP_WHEEL_SLOTS - 1)];
+        for (uint32_t id = *slot, next; id; id = next) {
+            next = map->events[id - 1].next;
+            wheel_insert(map, id);
+        }
+        *slot = 0;
+    }
+
+    /* Instead of checking every random tile every tick,
+     * the tick of first successful check is drawn from
+     * geometric distribution. Cells in cooldown are
+     * scheduled when the cooldown ends */
+    for (size_t i = 0; i < map->random_pending_count; i++) {
+        uint32_t cell = map->random_pending[i];
+        struct tile *tile = get_random_tile(map, cell);
+        if (!tile || map->ticked[cell] & RANDOM_COOLDOWN) continue;
+        schedule_random(map, cell, now + random_delay(seed, TILE_TYPE_RDIV(tile->type)), 0);
+    }
+    map->random_pending_count = 0;
+
+    /* Events can be scheduled to the current slot while it's processed */
+    uint32_t *slot = &map->wheel[0][now & (TILEMAP_WHEEL_SLOTS - 1)];
+    for (uint32_t id; (id = *slot); ) {
+        *slot = 0;
+        while (id) {
+            struct tick_event ev = map->events[id - 1];
+            map->events[id - 1].next = map->events_free;
+            map->events_free = id;
+            id = ev.next;
+
+            /* Cell was rescheduled since */
+            if (map->ticked[ev.cell] != ev.state) continue;
+
+            struct tile *tile = get_random_tile(map, ev.cell);
+            if (ev.state & RANDOM_COOLDOWN) {
+                map->ticked[ev.cell] &= ~RANDOM_COOLDOWN;
+                if (tile) schedule_random(map, ev.cell, now + random_delay(seed, TILE_TYPE_RDIV(tile->type)), 0);
                 continue;
             }
+            if (!tile) continue;
 
-            struct tileset *set = map->sets[TILESET_ID(tileid)];
-            struct tile *tile = &set->tiles[TILE_ID(tileid)];
-            if (!(tile->type & TILE_TYPE_RANDOM)) continue;
-            if (uniform_r(seed, 0, TILE_TYPE_RDIV(tile->type))) continue;
-
+            tile_t tileid = load_tile(map->tiles[ev.cell]);
             tile_t next = MKTILE(TILESET_ID(tileid), tile->next_frame);
             if (next != tileid) {
-                map->ticked[map->width*yi + xi] = TILE_TYPE_RREST(TILE_TYPE_CHAR(tile->type));
-                tilemap_set_tile_unsafe(map, xi, yi, 0, next);
+                int32_t x, y;
+                cell_pos(map, ev.cell, &x, &y);
+                schedule_random(map, ev.cell, now + TILE_TYPE_RREST(tile->type) + 1, 1);
+                tilemap_set_tile_unsafe(map, x, y, 0, next);
             }
         }
     }
+
+    map->tick++;
 }
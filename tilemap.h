@@ -14,6 +14,9 @@
 #define TILE_ID(x) ((x) & 0x3FF)
 #define MKTILE(set, id) (((set) << 10) | (id))
 #define NOTILE UINT32_MAX
+/* Tile maps store 16-bit tiles, so the last
+ * tileset id is reserved for NOTILE */
+#define TILEMAP_MAX_SETS 63
 
 #define TILE_TYPE_ANIMATED 0x1000
 #define TILE_TYPE_RANDOM 0x2000
@@ -23,10 +26,38 @@
 
 #define VOID ' '
 
+/* Layers that determine type of the cell,
+ * upper layers are only decorations */
+#define TILEMAP_TYPE_LAYERS 2
+/* Cell shape flags */
+#define TILEMAP_SHAPE_OPEN_BELOW 1 /* Cell below has different type */
+#define TILEMAP_SHAPE_SOLID_LEFT 2 /* Cell to the left is not VOID */
+#define TILEMAP_SHAPE_SOLID_RIGHT 4 /* Cell to the right is not VOID */
+
 typedef uint32_t tile_t;
 
+/* Number of scales tileset keeps pre-scaled sprites for */
+#define SPRITE_CACHE_SCALES 4
+
+/* Tiles pre-scaled for one scale, tiles are
+ * packed into slots of the fixed size and every
+ * row of a slot starts at a cache line */
+struct sprite_cache {
+    double scale;
+    struct image atlas;
+    int32_t slot_width;
+    int32_t slot_height;
+    /* Slot index + 1 for every tile of the set */
+    uint16_t *slots;
+    size_t nslots;
+    uint64_t last_used;
+};
+
 struct tileset {
     struct image img;
+    /* Mapped decoded image cache (if used) */
+    void *cache;
+    size_t cache_size;
     size_t ntiles;
     size_t refc;
     struct tile {
@@ -36,44 +67,215 @@ struct tileset {
         uint8_t rest;
         uint32_t type;
     } *tiles;
+    struct sprite_cache sprites[SPRITE_CACHE_SCALES];
+    uint64_t sprites_clock;
+};
+
+struct tile_placement {
+    tile_t tile;
+    int32_t x;
+    int32_t y;
+};
+
+/* Record of tile change journal */
+struct tile_change {
+    int32_t x;
+    int32_t y;
+    int32_t layer;
+    tile_t old;
+    tile_t new;
+};
+
+/* Order of cells in tile planes and bitsets */
+enum cell_order {
+    /* Row-major */
+    order_linear = 0,
+    /* Row-major 8x8 blocks of row-major cells,
+     * so that neighbouring cells share cache lines */
+    order_blocked = 1,
+};
+
+/* Random tile events are kept in hierarchical timing wheel */
+#define TILEMAP_WHEEL_BITS 6
+#define TILEMAP_WHEEL_SLOTS (1 << TILEMAP_WHEEL_BITS)
+#define TILEMAP_WHEEL_LEVELS 6
+
+struct tick_event {
+    uint32_t cell;
+    uint32_t due;
+    /* Next event in the slot (index + 1), 0 if last */
+    uint32_t next;
+    /* Cell random state this event is valid for */
+    uint8_t state;
+};
+
+/* Map cache is split into square chunks of tiles
+ * which are rendered lazily when drawn */
+#define TILEMAP_CHUNK 32
+
+struct map_chunk {
+    /* Rendered chunk, data is NULL if not resident */
+    struct image img;
+    /* Value of map clock when last drawn */
+    uint64_t last_used;
+    /* Neighbours in the list of resident chunks (index + 1), 0 if none */
+    uint32_t prev;
+    uint32_t next;
 };
 
 struct tilemap {
-    struct image cbuf;
+    struct map_chunk *chunks;
+    size_t chunks_width;
+    size_t chunks_height;
+    /* Temporary list of chunks to render */
+    size_t *chunk_list;
+    size_t resident_size;
+    /* Resident chunks from most to least recently drawn (index + 1) */
+    uint32_t lru_head;
+    uint32_t lru_tail;
+    uint64_t clock;
+    /* Chunks scaled to the current scale around the visible
+     * part, rectangle is in scaled pixels relative to the map */
+    struct image zoom;
+    struct rect zoom_rect;
     size_t nsets;
     struct tileset **sets;
     size_t width;
     size_t height;
+    enum cell_order order;
+    /* Row length of linear order (multiple of 32) */
+    size_t stride;
+    size_t blocks_width;
+    /* Number of cells in a plane (including padding) */
+    size_t plane_size;
     int32_t tile_width;
     int32_t tile_height;
     uint32_t *dirty;
+    /* One bit per chunk, set if chunk has dirty tiles */
+    uint64_t *dirty_chunks;
     uint32_t *visited;
-    uint32_t *ticked;
+    /* Sparse list of animated tiles (as indices
+     * into tiles) and bitset of listed tiles */
+    uint32_t *animated;
+    size_t animated_count;
+    size_t animated_caps;
+    uint32_t *animated_listed;
+    /* Type character of every cell (the upper not VOID type of type layers)
+     * stored xored with VOID, so that zero filled grid is VOID */
+    uint8_t *types;
+    /* Shape flags of every cell, derived from types of neighbours */
+    uint8_t *shapes;
+    /* Random state of every cell: generation
+     * of the last scheduled event and cooldown flag */
+    uint8_t *ticked;
+    /* Cells with random tiles waiting to be scheduled */
+    uint32_t *random_pending;
+    size_t random_pending_count;
+    size_t random_pending_caps;
+    struct tick_event *events;
+    size_t events_count;
+    size_t events_caps;
+    uint32_t events_free;
+    uint32_t wheel[TILEMAP_WHEEL_LEVELS][TILEMAP_WHEEL_SLOTS];
+    uint32_t tick;
     bool has_dirty;
+    /* Visible tiles are drawn straight from tilesets
+     * every frame instead of using the chunk cache */
+    bool immediate;
     double scale;
     double fade;
-    tile_t tiles[];
+    /* One plane per layer of 16-bit tiles (6-bit tileset and
+     * 10-bit tile id) stored plus one, so that zero is NOTILE */
+    uint16_t *tiles;
+    /* Size of tile planes followed by all other per cell grids
+     * and bitsets, which are allocated as a single block */
+    size_t cells_size;
+    /* Cell block is mapped from backing file instead of
+     * being allocated together with tilemap */
+    bool cells_mapped;
+    /* One bit per row of chunks, set if planes
+     * of the row may be resident (mapped cells only) */
+    uint64_t *streamed;
+    /* Ring buffer of recent tile changes (NULL if disabled),
+     * size is a power of two and positions only grow,
+     * consumers keep own cursors as positions */
+    struct tile_change *journal;
+    size_t journal_size;
+    uint64_t journal_head;
+    /* First position recorded by current journal */
+    uint64_t journal_start;
 };
 
 
+/* Index of cell in planes, bitsets and grids */
+inline static size_t tilemap_cell_index(struct tilemap *map, size_t x, size_t y) {
+    if (map->order == order_blocked)
+        return (((y >> 3)*map->blocks_width + (x >> 3)) << 6) + ((y & 7) << 3) + (x & 7);
+    return y*map->stride + x;
+}
+
+/* Gameplay type of the cell, cells outside of the map are VOID.
+ * Types and shapes are updated when tiles are set, so tile
+ * types should not be changed after tiles are placed */
+inline static char tilemap_cell_type(struct tilemap *map, int32_t x, int32_t y) {
+    if (x < 0 || x >= (int32_t)map->width) return VOID;
+    if (y < 0 || y >= (int32_t)map->height) return VOID;
+    return map->types[tilemap_cell_index(map, x, y)] ^ VOID;
+}
+
+inline static uint8_t tilemap_cell_shape(struct tilemap *map, int32_t x, int32_t y) {
+    if (x < 0 || x >= (int32_t)map->width) return 0;
+    if (y < 0 || y >= (int32_t)map->height) return 0;
+    return map->shapes[tilemap_cell_index(map, x, y)];
+}
+
 struct tileset *create_tileset(const char *path, struct tile *tiles, size_t ntiles);
 void unref_tileset(struct tileset *);
 void ref_tileset(struct tileset *);
 void tileset_queue_tile(struct image dst, struct tileset *set, tile_t tile, int32_t x, int32_t y, double scale);
+void tileset_queue_tiles(struct image dst, struct tileset **sets, const struct tile_placement *tiles, size_t ntiles, double scale);
 tile_t tileset_next_tile(struct tileset *set, tile_t tileid);
+/* Drop pre-scaled sprites of the scale, should not be called from jobs */
+void tileset_drop_sprites(struct tileset *set, double scale);
 
-struct tilemap *create_tilemap(size_t width, size_t height, int32_t tile_width, int32_t tile_height, struct tileset **sets, size_t nsets) ;
+/* If backing is not NULL, it is a directory where an anonymous file
+ * holding per cell data is created, so that the map can be paged out.
+ * No named file is created or modified there. Memory is used instead
+ * if the file cannot be created */
+struct tilemap *create_tilemap(size_t width, size_t height, int32_t tile_width, int32_t tile_height,
+                               struct tileset **sets, size_t nsets, enum cell_order order, const char *backing);
 void free_tilemap(struct tilemap *map);
 void tilemap_fade(struct tilemap *map, double val);
 tile_t tilemap_add_tileset(struct tilemap *map, struct tileset *tileset);
-void tilemap_queue_draw(struct image dst, struct tilemap *map, int32_t x, int32_t y);
+void tilemap_queue_draw(struct image dst, struct rect clip, struct tilemap *map, int32_t x, int32_t y);
 tile_t tilemap_set_tile(struct tilemap *map, int32_t x, int32_t y, int32_t layer, tile_t tile);
+/* Sets tiles of the layer inside of the rectangle at once
+ * from row-major array, stride is in tiles */
+void tilemap_set_rect(struct tilemap *map, struct rect rect, int32_t layer, const tile_t *tiles, size_t stride);
 void tilemap_set_scale(struct tilemap *map, double scale);
+void tilemap_set_immediate(struct tilemap *map, bool immediate);
 tile_t tilemap_get_tile(struct tilemap *map, int32_t x, int32_t y, int32_t layer);
 uint32_t tilemap_get_tiletype(struct tilemap *map, int32_t x, int32_t y, int32_t layer);
 void tilemap_animation_tick(struct tilemap *map);
 void tilemap_random_tick(struct tilemap *map, unsigned *seed);
-bool tilemap_refresh(struct tilemap *map);
+/* Renders dirty tiles inside of the view (in cells),
+ * the rest of them are kept dirty until they are in view */
+bool tilemap_refresh(struct tilemap *map, struct rect view);
 void tilemap_visit(struct tilemap *map, int32_t x, int32_t y);
+/* Visits cells of the rectangle (at most 64 cells wide)
+ * set in the bitmask rows, bit i of rows[j] is the cell
+ * (rect.x + i, rect.y + j), cells outside of the map are ignored */
+void tilemap_visit_rows(struct tilemap *map, struct rect rect, const uint64_t *rows);
+/* Enables journal of the last size (rounded up to power
+ * of two) tile changes, zero size disables it */
+void tilemap_set_journal(struct tilemap *map, size_t size);
+/* Cursor pointing after the last recorded change */
+uint64_t tilemap_journal_cursor(struct tilemap *map);
+/* Reads up to n changes after cursor and advances it. Returns the
+ * number of changes read or -1 if changes after cursor were already
+ * overwritten, then the consumer should rescan the map and continue
+ * from tilemap_journal_cursor(). Reenabling journal
+ * invalidates cursors the same way */
+ssize_t tilemap_read_journal(struct tilemap *map, uint64_t *cursor, struct tile_change *changes, size_t n);
 
 #endif
@@ -73,6 +73,25 @@ inline static struct rect rect_union(struct rect rect, struct rect other) {
     return rect;
 }
 
+inline static size_t rect_subtract(struct rect rect, struct rect hole, struct rect out[static 4]) {
+    /* Split rect into at most 4 parts that are not covered by hole
+     * (full-width top and bottom bands and left/right middle parts) */
+    int32_t x1 = MIN(rect.x + rect.width, hole.x + hole.width);
+    int32_t y1 = MIN(rect.y + rect.height, hole.y + hole.height);
+    int32_t x0 = MAX(rect.x, hole.x), y0 = MAX(rect.y, hole.y);
+    if (x1 <= x0 || y1 <= y0) {
+        out[0] = rect;
+        return 1;
+    }
+
+    size_t n = 0;
+    if (y0 > rect.y) out[n++] = (struct rect){rect.x, rect.y, rect.width, y0 - rect.y};
+    if (y1 < rect.y + rect.height) out[n++] = (struct rect){rect.x, y1, rect.width, rect.y + rect.height - y1};
+    if (x0 > rect.x) out[n++] = (struct rect){rect.x, y0, x0 - rect.x, y1 - y0};
+    if (x1 < rect.x + rect.width) out[n++] = (struct rect){x1, y0, rect.x + rect.width - x1, y1 - y0};
+    return n;
+}
+
 inline static bool intersect_with(struct rect *src, struct rect *dst) {
         struct rect inters = { .x = MAX(src->x, dst->x), .y = MAX(src->y, dst->y) };
 
@@ -95,6 +114,7 @@ inline static int32_t uniform_r(unsigned *seed, int32_t minn, int32_t maxn) {
     return minn + (maxn-minn+1)*(int64_t)rand_r(seed)/RAND_MAX;
 }
 
+void info(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 void warn(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 _Noreturn void die(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 
@@ -65,6 +65,10 @@ static struct context ctx;
 struct scale scale;
 struct image backbuf;
 bool want_exit;
+bool show_stats;
+bool immediate_map;
+int32_t frame_rate = FPS;
+int32_t tick_rate = FPS;
 
 _Noreturn void die(const char *fmt, ...) {
     va_list args;
@@ -76,6 +80,15 @@ _Noreturn void die(const char *fmt, ...) {
     exit(EXIT_FAILURE);
 }
 
+void info(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fputs("[\033[32;1mINFO\033[m] ", stderr);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
 void warn(const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
@@ -381,6 +394,7 @@ static void free_context(void) {
         xcb_destroy_window(ctx.con, ctx.wid);
     }
 
+    drain_image_pool();
     free(ctx.keymap);
 
     xcb_disconnect(ctx.con);
@@ -478,9 +492,35 @@ static void run(void) {
 
 }
 
+/* Parses rate option, dies if it is not a number in range [min, max] */
+static int32_t parse_rate(const char *arg, const char *name, int32_t min, int32_t max) {
+    char *end;
+    errno = 0;
+    long val = strtol(arg, &end, 10);
+    if (errno || end == arg || *end || val < min || val > max)
+        die("%s should be a number in range [%d, %d]", name, min, max);
+    return val;
+}
+
 int main(int argc, char **argv) {
-    (void)argc;
-    (void)argv;
+    for (int opt; (opt = getopt(argc, argv, "sif:t:")) != -1;) {
+        switch (opt) {
+        case 's':
+            show_stats = 1;
+            break;
+        case 'i':
+            immediate_map = 1;
+            break;
+        case 'f':
+            frame_rate = parse_rate(optarg, "Frame rate", MIN_FRAME_RATE, MAX_FRAME_RATE);
+            break;
+        case 't':
+            tick_rate = parse_rate(optarg, "Tick rate", MIN_TICK_RATE, MAX_TICK_RATE);
+            break;
+        default:
+            die("Usage: %s [-s] [-i] [-f <fps>] [-t <ticks per second>]", argv[0]);
+        }
+    }
 
     /* Load locale from environment
      * (only CTYPE aspect to not ruin numbers